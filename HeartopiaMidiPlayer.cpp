@@ -19,25 +19,59 @@
 #include <windows.h>
 #include <mmsystem.h>
 #include <CommCtrl.h>
+#include <avrt.h>
 
 // Requires MSVC
 #pragma comment(lib, "Comctl32.lib")
 #pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "Avrt.lib")
+
+// Only in newer SDKs (Windows 10 1803+). Older systems just fail the create, and we fall back.
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+// SIMD for the parser's note scanning. SSE2 is a given on x64; AVX2 only if the build says so (/arch:AVX2).
+// Anything else (ARM, say) gets the plain loop, which gives the same answers.
+#if defined(__AVX2__)
+#define HEARTOPIA_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HEARTOPIA_SSE2 1
+#include <immintrin.h>
+#endif
 
 
 #include <fstream>
 #include <vector>
+#include <span>
+#include <string_view>
 #include <unordered_map>
-#include <unordered_set>
+#include <bitset>
+#include <array>
+#include <utility>
+#include <initializer_list>
 #include <algorithm>
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <functional>
+#include <cstring>
+#include <charconv>
+#include <bit>
 #include <atomic>
 #include <stdexcept>
 #include <string>
 #include <optional>
+#include <memory>
+#include <exception>
+#include <tuple>
 #include <cstdint>
+#include <cstdio>
+#include <climits>
 
 // Dedicated exception for MIDI file errors
 class MidiFileException : public std::runtime_error { using runtime_error::runtime_error; };
@@ -46,12 +80,18 @@ class MidiFileException : public std::runtime_error { using runtime_error::runti
 class MidiDeviceException : public std::runtime_error { using runtime_error::runtime_error; };
 
 
+// A key press or release, already turned into what SendInput wants.
+struct KeyStroke {
+	WORD scanCode;
+	WORD flags; // KEYEVENTF_* bits. They all fit in a WORD, so no point in a DWORD.
+};
+
 class KeyboardEmitter {
 private: // Defaults, I know. Explicit though :pleading:
 
 	// Turn from a vk (int) to a scancode (WORD).
 	// Allows mapping text characters to keyboard buttons, basically.
-	WORD GetScanCode(int vKey) const {
+	static WORD GetScanCode(int vKey, HKL layout) {
 		// These characters misbehave with MapVirtualKey, so do them manually.
 		// A full generic list, although we'll only need a couple. Remove them if you want IG. Saves a couple CPU instructions?
 		static const std::unordered_map<int, WORD> manual{
@@ -70,12 +110,12 @@ private: // Defaults, I know. Explicit though :pleading:
 		if (auto it = manual.find(vKey); it != manual.end())
 			return it->second;
 
-		// And, convert to scancode
-		return (WORD)MapVirtualKey(vKey, MAPVK_VK_TO_VSC);
+		// And, convert to scancode, for the keyboard layout we were given.
+		return (WORD)MapVirtualKeyEx(vKey, MAPVK_VK_TO_VSC, layout);
 	}
 
 	// Use a couple range checks, since it's pretty fast
-	inline bool IsExtended(int vKey) const {
+	static inline bool IsExtended(int vKey) {
 		return (vKey >= VK_PRIOR && vKey <= VK_DOWN) || // Page Up/Down, End, Home, Arrows
 			(vKey >= VK_INSERT && vKey <= VK_DELETE) || // Insert, Delete
 			(vKey == VK_LWIN || vKey == VK_RWIN) ||     // Windows keys
@@ -84,422 +124,3320 @@ private: // Defaults, I know. Explicit though :pleading:
 			(vKey == VK_RMENU);                         // Right Alt
 	}
 
+	// Final scancode (low word) & KEYEVENTF flags (high word) for every VK, worked out once instead of per keystroke.
+	// Atomic, since the layout can change from the UI thread while the live callback is reading. Relaxed loads are just a mov anyway.
+	std::array<std::atomic<uint32_t>, 256> codes{};
+
+protected:
+	// Where a finished batch actually goes. Swapped out for the dry run & benchmarks, so they go through all the same batching.
+	virtual void Dispatch(std::span<INPUT> inputs) const {
+		// And finally, send the inputs. This emulated keyboard presses, basically.
+		SendInput((UINT)inputs.size(), inputs.data(), sizeof(INPUT));
+	}
+
 public:
-	void SendKey(int vKey, bool pressed) const {
-		// First, create an INPUT (Windows struct :P) using our input 
-		INPUT input{};
-		input.type = INPUT_KEYBOARD;
-		input.ki.wVk = 0;
-		input.ki.wScan = GetScanCode(vKey); // Scancode instead of vk, since vk is for typing & scancode is for input.
-		input.ki.dwFlags = KEYEVENTF_SCANCODE;
+	explicit KeyboardEmitter(HKL layout) {
+		RefreshLayout(layout);
+	}
+
+	virtual ~KeyboardEmitter() = default;
+
+	// Call when the keyboard layout changes (WM_INPUTLANGCHANGE), since the scancodes depend on it.
+	void RefreshLayout(HKL layout) {
+		for (int vKey = 0; vKey < (int)codes.size(); ++vKey) {
+			// Scancode instead of vk, since vk is for typing & scancode is for input.
+			uint32_t flags = KEYEVENTF_SCANCODE;
+
+			// If it's an extended range key, enable extended. Crazy, I know.
+			if (IsExtended(vKey))
+				flags |= KEYEVENTF_EXTENDEDKEY;
 
-		// If it's an extended range key, enable extended. Crazy, I know.
-		if (IsExtended(vKey))
-			input.ki.dwFlags |= KEYEVENTF_EXTENDEDKEY;
+			codes[vKey].store(GetScanCode(vKey, layout) | (flags << 16), std::memory_order_relaxed);
+		}
+	}
+
+	// Work out everything SendInput needs for a key, without sending it.
+	KeyStroke Resolve(int vKey, bool pressed) const {
+		uint32_t code = codes[vKey & 0xFF].load(std::memory_order_relaxed);
+		KeyStroke key{(WORD)code, (WORD)(code >> 16)};
 
 		// If it's being unpressed, flip this flag.
 		if (!pressed)
-			input.ki.dwFlags |= KEYEVENTF_KEYUP;
+			key.flags |= KEYEVENTF_KEYUP;
 
-		// And finally, send the input. This emulated a keyboard press, basically.
-		SendInput(1, &input, sizeof(INPUT));
+		return key;
 	}
-};
 
+	// Send a bunch of keystrokes in one SendInput, so a chord lands in the game as one thing instead of N syscalls spread over frames.
+	void SendKeys(std::span<const KeyStroke> keys) const {
+		// Stack buffer, so sending never allocates. Anything bigger than this goes in chunks, back to back.
+		// If you're playing a 64 note chord, a handful of microseconds between halves is the least of your problems.
+		constexpr size_t batchSize = 64;
+		std::array<INPUT, batchSize> inputs{};
+
+		while (!keys.empty()) {
+			size_t count = std::min(keys.size(), batchSize);
+
+			// First, create INPUTs (Windows struct :P) using our inputs
+			for (size_t i = 0; i < count; ++i) {
+				inputs[i].type = INPUT_KEYBOARD;
+				inputs[i].ki.wVk = 0;
+				inputs[i].ki.wScan = keys[i].scanCode;
+				inputs[i].ki.dwFlags = keys[i].flags;
+			}
 
-class MidiMapper {
-private:
-	// Here in chars & VKs to allow easy editing.
-
-	// Type doesn't allow in-class definition or whatever. Sure.
-	// Plus, avoids initialising into memory when unused, I think? Unless it loads anyway. I dunno.
-	static std::unordered_map<int, int> fullMap() {
-		return {
-			{48, VK_OEM_COMMA},{49, 'L'},{50, VK_OEM_PERIOD},{51, VK_OEM_1},
-			{52, VK_OEM_2},{53, 'O'},{54, '0'},{55, 'P'},{56, VK_OEM_MINUS},
-			{57, VK_OEM_4},{58, VK_OEM_PLUS},{59, VK_OEM_6},
-			{60,'Z'},{61,'S'},{62,'X'},{63,'D'},{64,'C'},
-			{65,'V'},{66,'G'},{67,'B'},{68,'H'},{69,'N'},
-			{70,'J'},{71,'M'},{72,'Q'},{73,'2'},{74,'W'},
-			{75,'3'},{76,'E'},{77,'R'},{78,'5'},{79,'T'},
-			{80,'6'},{81,'Y'},{82,'7'},{83,'U'},{84,'I'}
-		};
+			Dispatch({inputs.data(), count});
+			keys = keys.subspan(count);
+		}
 	}
 
-	// ^ Ditto
-	static std::unordered_map<int, int> whitesMap() {
-		return {
-			{60,'A'},{62,'S'},{64,'D'},{65,'F'},{67,'G'},
-			{69,'H'},{71,'J'},{72,'Q'},{74,'W'},{76,'E'},
-			{77,'R'},{79,'T'},{81,'Y'},{83,'U'},{84,'I'}
-		};
+	void Send(KeyStroke key) const {
+		SendKeys({&key, 1});
 	}
 
-	// The map in question.
-	std::unordered_map<int, int> map;
-
-public:
-	// Constructor :yippee:
-	explicit MidiMapper(bool whitesOnly) {
-		if (whitesOnly)
-			map = whitesMap();
-		else
-			map = fullMap();
+	void SendKey(int vKey, bool pressed) const {
+		Send(Resolve(vKey, pressed));
 	}
+};
 
-	std::optional<int> MapNote(int note) const {
-		// Find an iterator to the note in the map, if it exists. Then return the corresponding key.
-		// Also, inverted for the in-if init statement. Thanks for reminding me, linter.
-		if (auto it = map.find(note); it != map.end())
-			return it->second;
+// Pretends to be the keyboard: writes down what would've been sent, and when, instead of sending it.
+// For --dry-run, so a song (or a change to the engine) can be checked without a game open or keys going everywhere.
+// Nothing gets printed until Write, so logging doesn't throw the timing off.
+// The log's fixed size chunks that never move, so even a long song never copies it around in the middle of playing.
+class DryRunEmitter : public KeyboardEmitter {
+private:
+	struct Entry {
+		std::chrono::steady_clock::duration time; // Since the first key.
+		KeyStroke key;
+	};
 
-		return std::nullopt;
+	// A megabyte a chunk. A new one's one allocation (not even zeroed), and only every 64K keys.
+	static constexpr size_t chunkSize = 64 * 1024;
+
+	mutable std::vector<std::unique_ptr<Entry[]>> chunks;
+	mutable size_t count = 0;
+	mutable std::optional<std::chrono::steady_clock::time_point> first;
+
+	const Entry& At(size_t i) const {
+		return chunks[i / chunkSize][i % chunkSize];
 	}
 
-	int GetExtremeValue(auto Sort) {
-		if (map.empty())
-			return 0;
+protected:
+	void Dispatch(std::span<INPUT> inputs) const override {
+		const auto now = std::chrono::steady_clock::now();
+		if (!first)
+			first = now;
 
-		// Start with the first value in the map.
-		int mostValue = map.begin()->first;
+		for (const INPUT& input : inputs) {
+			if (count == chunks.size() * chunkSize)
+				chunks.push_back(std::make_unique_for_overwrite<Entry[]>(chunkSize));
 
-		// For each value, sort it based on the lambda to find the most extreme.
-		for (auto [note, _] : map) {
-			if (Sort(note, mostValue))
-				mostValue = note;
+			chunks.back()[count++ % chunkSize] = {now - *first, {input.ki.wScan, (WORD)input.ki.dwFlags}};
 		}
+	}
+
+public:
+	explicit DryRunEmitter(HKL layout) : KeyboardEmitter(layout) {
+		// Room for the chunk pointers of a 64M key song, and the first chunk, up front.
+		chunks.reserve(1024);
+		chunks.push_back(std::make_unique_for_overwrite<Entry[]>(chunkSize));
+	}
 
-		return mostValue;
+	size_t Count() const {
+		return count;
+	}
+
+	// One line per key: milliseconds since the first key, scancode, and down/up.
+	void Write(FILE* out) const {
+		for (size_t i = 0; i < count; ++i) {
+			const Entry& entry = At(i);
+			const double ms = std::chrono::duration<double, std::milli>(entry.time).count();
+			fprintf(out, "%10.3f %s0x%02X %s\n", ms, (entry.key.flags & KEYEVENTF_EXTENDEDKEY) ? "E0 " : "",
+				entry.key.scanCode, (entry.key.flags & KEYEVENTF_KEYUP) ? "up" : "down");
+		}
 	}
 };
 
-// Struct to store midi events. Self-descriptive, really.
-struct MidiEvent {
-	uint64_t timeMs; // I LOVE UNSIGNED DATA TYPES. I LOVE CSTDINT. I LOVE ALL UINT##_T TYPES. I HATE UNPACKING OVERHEAD. darn.
-	int note;
-	bool noteOn;
+
+// A note -> key layout, flattened into a table indexed by MIDI note. Notes are only 0-127, so 128 entries covers everything.
+struct KeyLayout {
+	std::array<uint16_t, 128> keys{}; // VK for each note. 0 means no key.
+	int min = 0; // Lowest & highest mapped note, for compressing.
+	int max = 0;
 };
 
-class MidiFileParser {
+// Build a layout from note/key pairs at compile time. Consteval, so a typo'd note number is a compile error instead of a crash.
+consteval KeyLayout MakeLayout(std::initializer_list<std::pair<int, int>> pairs) {
+	KeyLayout layout{};
+	layout.min = 127;
+	layout.max = 0;
+
+	for (auto [note, vKey] : pairs) {
+		layout.keys.at(note) = (uint16_t)vKey;
+		layout.min = std::min(layout.min, note);
+		layout.max = std::max(layout.max, note);
+	}
+
+	return layout;
+}
+
+// The built in layouts. Here in chars & VKs to allow easy editing.
+// Constexpr tables, so they're baked into the exe. No building maps at runtime, no hashing, no allocating.
+constexpr KeyLayout fullLayout = MakeLayout({
+	{48, VK_OEM_COMMA},{49, 'L'},{50, VK_OEM_PERIOD},{51, VK_OEM_1},
+	{52, VK_OEM_2},{53, 'O'},{54, '0'},{55, 'P'},{56, VK_OEM_MINUS},
+	{57, VK_OEM_4},{58, VK_OEM_PLUS},{59, VK_OEM_6},
+	{60,'Z'},{61,'S'},{62,'X'},{63,'D'},{64,'C'},
+	{65,'V'},{66,'G'},{67,'B'},{68,'H'},{69,'N'},
+	{70,'J'},{71,'M'},{72,'Q'},{73,'2'},{74,'W'},
+	{75,'3'},{76,'E'},{77,'R'},{78,'5'},{79,'T'},
+	{80,'6'},{81,'Y'},{82,'7'},{83,'U'},{84,'I'}
+});
+
+// ^ Ditto
+constexpr KeyLayout whitesLayout = MakeLayout({
+	{60,'A'},{62,'S'},{64,'D'},{65,'F'},{67,'G'},
+	{69,'H'},{71,'J'},{72,'Q'},{74,'W'},{76,'E'},
+	{77,'R'},{79,'T'},{81,'Y'},{83,'U'},{84,'I'}
+});
+
+class MidiMapper {
 private:
-	// Intermediate event stored with tick time (before tempo conversion)
-	struct RawEvent {
-		uint32_t tick;
-		int note;
-		bool noteOn;
-	};
+	// The layout in question. Lives in a LayoutLibrary (or is one of the built in ones), which outlives us.
+	const KeyLayout* layout;
 
-	// A tempo change at a specific tick position
-	struct TempoChange {
-		uint32_t tick;
-		uint32_t tempo; // microseconds per quarter note
-	};
+public:
+	// Constructor :yippee:
+	explicit MidiMapper(const KeyLayout& layout) : layout(&layout) {}
 
-	// Convert an absolute tick position to microseconds using the global tempo map.
-	// This ensures all tracks share the same tempo changes, fixing multi-track timing.
-	static uint64_t TickToUs(uint32_t tick, const std::vector<TempoChange>& tempoMap, uint16_t tpqn) {
-		uint64_t us = 0;
-		uint32_t lastTick = 0;
-		uint32_t currentTempo = 500000; // default 120 BPM
+	std::optional<int> MapNote(int note) const {
+		// Transposing can push a note out of MIDI range, and then it's definitely not mapped.
+		if ((unsigned)note >= layout->keys.size())
+			return std::nullopt;
 
-		for (const auto& tc : tempoMap) {
-			if (tc.tick >= tick) break;
-			us += (uint64_t)(tc.tick - lastTick) * currentTempo / tpqn;
-			lastTick = tc.tick;
-			currentTempo = tc.tempo;
-		}
+		// Otherwise it's just an array read.
+		if (int key = layout->keys[note]; key != 0)
+			return key;
 
-		us += (uint64_t)(tick - lastTick) * currentTempo / tpqn;
-		return us;
+		return std::nullopt;
 	}
 
+	// Lowest & highest mapped notes. Worked out when the table was built, so these are free.
+	int Min() const { return layout->min; }
+	int Max() const { return layout->max; }
+};
+
+// Every layout there is: the built in two, then whatever's in layouts.ini. Loaded once at startup and never changed after,
+// so anything can hang on to a KeyLayout& from in here, and switching layouts is just pointing at a different one.
+//
+// layouts.ini looks like this. Notes are MIDI numbers or names (C4 is middle C, 60), keys are a letter, digit,
+// one of , . ; / ` [ \ ] ' - =, Space, or a VK number (0x..).
+//   ; Comment
+//   [Harp]
+//   C4 = A
+//   C#4 = W
+//   62 = S
+class LayoutLibrary {
 public:
-	static std::vector<MidiEvent> Parse(const std::string& path) {
-		// Step 1: Open the file.
-		std::ifstream file(path, std::ios::binary);
+	struct Entry {
+		std::string name;
+		KeyLayout layout;
+	};
 
-		// File failed to open.
-		if (!file)
-			throw MidiFileException("Failed to open MIDI file");
+private:
+	std::vector<Entry> entries;
+	std::string error; // First thing wrong with the file, if anything was.
+
+	static std::string_view Trim(std::string_view text) {
+		while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+			text.remove_prefix(1);
+		while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r'))
+			text.remove_suffix(1);
+		return text;
+	}
 
-		// Invalid file header- not midi.
-		if (ReadString(file, 4) != "MThd")
-			throw MidiFileException("Invalid MIDI header");
+	// "60", or "C4", "C#4", "Db4", "A-1". -1 if it's neither.
+	static int ParseNote(std::string_view text) {
+		int value = 0;
+		if (auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value); ec == std::errc() && end == text.data() + text.size())
+			return value >= 0 && value <= 127 ? value : -1;
 
-		uint32_t headerLength = Read32(file);
-		std::streampos headerStart = file.tellg();
-		Read16(file); // format
-		uint16_t tracks = Read16(file);
-		uint16_t tpqn = Read16(file); // Ticks per quarter note
+		static constexpr int semitones[] = {9, 11, 0, 2, 4, 5, 7}; // A B C D E F G
+		if (text.size() < 2)
+			return -1;
 
-		// Skip any extra header bytes
-		if (headerLength > 6) {
-			file.seekg(headerStart + static_cast<std::streamoff>(headerLength));
+		const char letter = (char)(text[0] & ~0x20);
+		if (letter < 'A' || letter > 'G')
+			return -1;
+
+		int note = semitones[letter - 'A'];
+		text.remove_prefix(1);
+
+		if (text[0] == '#' || text[0] == 'b') {
+			note += text[0] == '#' ? 1 : -1;
+			text.remove_prefix(1);
 		}
 
-		std::vector<RawEvent> rawEvents;
-		std::vector<TempoChange> tempoMap;
+		int octave = 0;
+		if (auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), octave); ec != std::errc() || end != text.data() + text.size())
+			return -1;
 
-		for (int tr = 0; tr < tracks; ++tr) {
-			if (ReadString(file, 4) != "MTrk")
-				throw MidiFileException("Invalid track header");
+		note += (octave + 1) * 12;
+		return note >= 0 && note <= 127 ? note : -1;
+	}
 
-			auto trackLength = Read32(file);
-			auto trackEnd = file.tellg() + (std::streamoff)trackLength;
+	// A key name to a VK. 0 if it isn't one.
+	static int ParseKey(std::string_view text) {
+		static constexpr std::pair<char, int> punctuation[] = {
+			{',', VK_OEM_COMMA}, {'.', VK_OEM_PERIOD}, {';', VK_OEM_1}, {'/', VK_OEM_2},
+			{'`', VK_OEM_3}, {'[', VK_OEM_4}, {'\\', VK_OEM_5}, {']', VK_OEM_6},
+			{'\'', VK_OEM_7}, {'-', VK_OEM_MINUS}, {'=', VK_OEM_PLUS}
+		};
 
-			uint32_t tick = 0;
-			uint8_t lastStatus = 0;
+		if (text.size() == 1) {
+			const char c = text[0];
+			if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+				return c;
+			if (c >= 'a' && c <= 'z')
+				return c - 'a' + 'A';
 
-			while (file.tellg() < trackEnd) {
-				uint32_t delta = ReadVar(file);
-				tick += delta;
+			for (auto [name, vKey] : punctuation)
+				if (name == c)
+					return vKey;
+			return 0;
+		}
 
-				uint8_t status = 0;
-				file.read((char*)&status, 1);
+		if (text == "Space" || text == "space")
+			return VK_SPACE;
 
-				if (status < 0x80) {
-					file.seekg(-1, std::ios::cur);
-					status = lastStatus;
-				} else {
-					lastStatus = status;
-				}
+		int vKey = 0;
+		if (text.starts_with("0x") || text.starts_with("0X")) {
+			if (auto [end, ec] = std::from_chars(text.data() + 2, text.data() + text.size(), vKey, 16); ec == std::errc() && end == text.data() + text.size())
+				return vKey > 0 && vKey < 256 ? vKey : 0;
+		}
 
-				uint8_t type = status & 0xF0;
+		return 0;
+	}
 
-				if (type == 0x90 || type == 0x80) {
-					uint8_t note = 0;
-					uint8_t vel = 0;
-					file.read((char*)&note, 1);
-					file.read((char*)&vel, 1);
+	void Fail(size_t line, const std::string& what) {
+		if (error.empty())
+			error = "layouts.ini line " + std::to_string(line) + ": " + what;
+	}
 
-					rawEvents.push_back({tick, note, type == 0x90 && vel > 0});
-				} else if (status == 0xFF) {
-					uint8_t metaType = 0;
-					file.read((char*)&metaType, 1);
-					uint32_t len = ReadVar(file);
+public:
+	LayoutLibrary() {
+		entries.push_back({"22 keys", fullLayout});
+		entries.push_back({"15 keys (Double Row)", whitesLayout});
+	}
 
-					if (metaType == 0x51 && len == 3) {
-						uint8_t buf[3]{};
-						file.read((char*)buf, 3);
-						uint32_t newTempo = (buf[0] << 16) | (buf[1] << 8) | buf[2];
-						tempoMap.push_back({tick, newTempo});
-					} else {
-						file.seekg(len, std::ios::cur);
-					}
-				} else {
-					SkipEvent(file, status);
-				}
+	// Add every layout in an ini file. No file's fine, there's just nothing extra.
+	// Bad lines get skipped (the first one's kept in Error()), and layouts that come out empty get dropped.
+	void LoadFile(const std::string& path) {
+		std::ifstream in(path);
+		if (!in)
+			return;
+
+		std::optional<Entry> current;
+		auto finish = [&] {
+			if (current && current->layout.max >= current->layout.min)
+				entries.push_back(std::move(*current));
+			current.reset();
+		};
+
+		std::string raw;
+		for (size_t line = 1; std::getline(in, raw); ++line) {
+			std::string_view text = Trim(raw);
+			if (text.empty() || text[0] == ';' || text[0] == '#')
+				continue;
+
+			if (text.front() == '[' && text.back() == ']') {
+				finish();
+				current = Entry{std::string(Trim(text.substr(1, text.size() - 2))), {}};
+				current->layout.min = 127;
+				current->layout.max = 0;
+				continue;
 			}
 
-			file.seekg(trackEnd);
-		}
+			const size_t equals = text.find('=', 1); // From 1, so "= = ..." isn't a problem. Notes can't start with one anyway.
+			if (!current || equals == std::string_view::npos) {
+				Fail(line, current ? "expected note = key" : "expected a [layout name] first");
+				continue;
+			}
 
-		// Sort tempo map by tick position
-		std::ranges::sort(tempoMap, [](const auto& a, const auto& b) { return a.tick < b.tick; });
+			const std::string_view noteText = Trim(text.substr(0, equals));
+			const std::string_view keyText = Trim(text.substr(equals + 1));
+			const int note = ParseNote(noteText);
+			const int vKey = ParseKey(keyText);
 
-		// Convert tick-based events to real-time events using the global tempo map
-		std::vector<MidiEvent> events;
-		events.reserve(rawEvents.size());
+			if (note < 0 || vKey == 0) {
+				Fail(line, note < 0 ? "bad note '" + std::string(noteText) + "'" : "bad key '" + std::string(keyText) + "'");
+				continue;
+			}
 
-		for (const auto& raw : rawEvents) {
-			events.push_back({TickToUs(raw.tick, tempoMap, tpqn) / 1000, raw.note, raw.noteOn});
+			KeyLayout& layout = current->layout;
+			layout.keys[note] = (uint16_t)vKey;
+			layout.min = std::min(layout.min, note);
+			layout.max = std::max(layout.max, note);
 		}
 
-		// Sort the events by time.
-		std::ranges::sort(events, [](const auto& a, const auto& b) { return a.timeMs < b.timeMs; });
+		finish();
+	}
+
+	size_t Count() const { return entries.size(); }
+	const Entry& operator[](size_t i) const { return entries[i]; }
+	const std::string& Error() const { return error; }
 
-		return events;
+	// By name, for the command line. Case has to match; it's not that deep.
+	std::optional<size_t> Find(std::string_view name) const {
+		for (size_t i = 0; i < entries.size(); ++i)
+			if (entries[i].name == name)
+				return i;
+		return std::nullopt;
 	}
+};
+
+// Struct to store midi events. Self-descriptive, really.
+struct MidiEvent {
+	uint64_t timeMs; // I LOVE UNSIGNED DATA TYPES. I LOVE CSTDINT. I LOVE ALL UINT##_T TYPES. I HATE UNPACKING OVERHEAD. darn.
+	int note;
+	bool noteOn;
+};
 
+// A whole song's notes, structure-of-arrays: a time & a note byte each, so 5 bytes an event instead of a padded MidiEvent's 16.
+// Both arrays are allocated once, at their full size, and filled in place. Never grows.
+class MidiEvents {
 private:
-	static inline uint32_t ReadVar(std::ifstream& f) {
-		uint32_t value = 0;
-		uint8_t c = 0;
+	std::unique_ptr<uint32_t[]> times; // Milliseconds. (Ticks, while the parser's still working on it.)
+	std::unique_ptr<uint8_t[]> notes;  // Note number, with the top bit set for note on.
+	size_t count = 0;
+	size_t capacity = 0;
 
-		// OKAY, so
-		// If the first bit is 1, more data follows. Otherwise, this is the end. 
-		// It's also only up to 4 bytes in length, so we add a hard limit there, too.
-		// If this is data, shift it & add the 7 right bits.
-		// (value = value * 128 + next 7 bits)
-		for (int i = 0; i < 4; ++i) {  // MIDI VLQ max 4 bytes
-			f.read(reinterpret_cast<char*>(&c), 1);
-			value = (value << 7) | (c & 0x7F);
+public:
+	static constexpr uint8_t onBit = 0x80;
 
-			if (!(c & 0x80)) // End!
-				return value;
-		}
+	MidiEvents() = default;
 
-		// Bruh
-		return value;
-	}
+	// Room for `capacity` events, left uninitialised. SetSize once they're actually in.
+	explicit MidiEvents(size_t capacity)
+		: times(std::make_unique_for_overwrite<uint32_t[]>(capacity)), notes(std::make_unique_for_overwrite<uint8_t[]>(capacity)), capacity(capacity) {}
 
-	static inline uint32_t Read32(std::ifstream& f) {
-		// Read 4 bytes in big-endian order (MIDI standard)
-		uint8_t b[4]{};
-		f.read(reinterpret_cast<char*>(b), 4);
-		return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	void SetSize(size_t size) {
+		count = std::min(size, capacity);
 	}
 
+	uint32_t* Times() { return times.get(); }
+	uint8_t* Notes() { return notes.get(); }
 
-	static inline uint16_t Read16(std::ifstream& f) {
-		// Read 2 bytes in big-endian order (MIDI standard)
-		uint8_t b[2]{};
-		f.read(reinterpret_cast<char*>(b), 2);
-		return (uint16_t(b[0]) << 8) | uint16_t(b[1]);
+	MidiEvent operator[](size_t i) const {
+		return {times[i], notes[i] & 0x7F, (notes[i] & onBit) != 0};
 	}
+};
 
-	static inline std::string ReadString(std::ifstream& f, size_t n) {
-		// Erm... Pretty straightforward.
-		// String. Read. Return.
-		std::string s(n, ' ');
-		f.read(s.data(), n);
-		return s;
-	}
+// Read-only view of a whole file. Memory-mapped, so the parser can walk the bytes without a stream op per byte.
+class MappedFile {
+private:
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping{};
+	const uint8_t* view = nullptr;
+	size_t size = 0;
 
-	static void SkipEvent(std::ifstream& f, uint8_t status) {
-		/*
-		Status contains the event type. One of the following:
-		- 0x80 Note Off
-		- 0x90 Note On
-		- 0xA0 Polyphonic key pressure
-		- 0xB0 Control Change
-		- 0xC0 Program Change
-		- 0xD0 Channel pressure
-		- 0xE0 Pitch bend
-		*/
+public:
+	explicit MappedFile(const std::string& path) {
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			throw MidiFileException("Failed to open MIDI file");
 
-		// Get top 4 bits of the status.
-		uint8_t type = status & 0xF0;
+		LARGE_INTEGER length{};
+		if (!GetFileSizeEx(file, &length)) {
+			CloseHandle(file);
+			throw MidiFileException("Failed to open MIDI file");
+		}
 
-		// Program Change or Channel pressure. Skip 1.
-		if (type == 0xC0 || type == 0xD0)
-			f.seekg(1, std::ios::cur);
+		size = (size_t)length.QuadPart;
 
-		// Polyphonic key pressure, Control Change, or Pitch bend. Skip 2.
-		else if (type == 0xA0 || type == 0xB0 || type == 0xE0)
-			f.seekg(2, std::ios::cur);
+		// Windows refuses to map an empty file. An empty span is fine though, the parser will complain about the header.
+		if (size == 0)
+			return;
 
-		// Meta event
-		else if (status == 0xFF) {
-			uint8_t metaType = 0;
-			f.read(reinterpret_cast<char*>(&metaType), 1);
-			f.seekg(ReadVar(f), std::ios::cur);
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+			view = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+
+		if (!view) {
+			if (mapping)
+				CloseHandle(mapping);
+			CloseHandle(file);
+			throw MidiFileException("Failed to open MIDI file");
 		}
+	}
 
-		// System something or-rather. Check the length, then skip the length.
-		else if (status == 0xF0 || status == 0xF7)
-			f.seekg(ReadVar(f), std::ios::cur);
+	~MappedFile() {
+		if (view)
+			UnmapViewOfFile(view);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+	}
+
+	// Owns handles, so no copying. Two unmaps of the same view would be fun, but no.
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::span<const uint8_t> Bytes() const {
+		return {view, view ? size : 0};
 	}
 };
 
-// Small function to make a number fit in a range.
-int Compress(int note, int min, int max) {
-	if (note < min)
-		while (note < min)
-			note += 12;
-	else while (note > max)
-		note -= 12;
+// Quick 64-bit content hash, for telling files apart. Eats a word at a time, so it keeps up with the mapped file.
+// Not cryptographic, just really unlikely to collide (and the size gets mixed in too).
+inline uint64_t HashBytes(std::span<const uint8_t> data) {
+	constexpr uint64_t prime = 0x100000001B3;
+	uint64_t hash = 0xCBF29CE484222325 ^ data.size();
+
+	size_t i = 0;
+	for (; i + 8 <= data.size(); i += 8) {
+		uint64_t word = 0;
+		memcpy(&word, data.data() + i, 8);
+		hash = (hash ^ word) * prime;
+		hash ^= hash >> 29;
+	}
 
-	return note;
+	for (; i < data.size(); ++i)
+		hash = (hash ^ data[i]) * prime;
+
+	// Final mix, so the last few bytes reach all the bits.
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCD;
+	hash ^= hash >> 33;
+	return hash;
 }
 
+// The global tempo map. Turns ticks into microseconds.
+// The time at every tempo change is summed up once, up front, so a lookup is a binary search instead of a walk from tick 0.
+class TempoMap {
+public:
+	// A tempo change at a specific tick position
+	struct TempoChange {
+		uint32_t tick;
+		uint32_t tempo; // microseconds per quarter note
+	};
 
-class MidiLiveInput {
-private:
-	HMIDIIN handle{}; // Every Windows handle makes me want to cry.
-	MidiMapper& mapper;
-	KeyboardEmitter& emitter;
-	std::unordered_set<int> pressed;
-	int min = 0;
-	int max = 0;
-	int transpose = 0;
-	bool compress = false;
-	std::mutex mutex;
+	// Walks a TempoMap forwards. For tick-sorted input this is O(1) amortised per lookup, so a whole track is O(n + t).
+	class Cursor {
+	private:
+		const TempoMap& map;
+		size_t segment = 0;
 
-	static void CALLBACK Callback(HMIDIIN, UINT msg, DWORD_PTR instance, DWORD_PTR param1, DWORD_PTR) {
-		// If it's not data, just return.
-		// MIM is midi callback messages, btw. Just in case you care. :pleading:
-		if (msg != MIM_DATA) return;
+	public:
+		explicit Cursor(const TempoMap& map) : map(map) {}
 
-		// Should I do reinterpret(static<void>(instance)) to get the linter to shut up? Do I care? Unsafe my ass.
-		auto* self = reinterpret_cast<MidiLiveInput*>(instance);
+		uint64_t TickToUs(uint32_t tick) {
+			const auto& segments = map.segments;
 
-		uint8_t status = param1 & 0xFF;
-		uint8_t note = (uint8_t)self->transpose + ((param1 >> 8) & 0xFF);
-		uint8_t vel = (param1 >> 16) & 0xFF;
+			// Went backwards (new track or whatever). Just binary search to the right spot again.
+			if (tick < segments[segment].tick)
+				segment = map.Find(tick);
 
-		if (self->compress)
-			note = (uint8_t)Compress(note, self->min, self->max);
+			while (segment + 1 < segments.size() && segments[segment + 1].tick <= tick)
+				++segment;
 
-		// Get the mapped key.
-		auto mapped = self->mapper.MapNote(note);
+			return map.At(segments[segment], tick);
+		}
+	};
 
-		// It's optional.
-		if (!mapped.has_value())
-			return;
+	TempoMap(std::vector<TempoChange> changes, uint16_t tpqn) : tpqn(tpqn) {
+		// Sort tempo map by tick position. Stable, so two changes on the same tick keep their file order.
+		std::ranges::stable_sort(changes, [](const auto& a, const auto& b) { return a.tick < b.tick; });
 
-		// Mutex, to avoid multithreading issues or smth. Jthread my beloved.
-		std::scoped_lock lock(self->mutex);
+		segments.reserve(changes.size() + 1);
+		segments.push_back({0, 500000, 0}); // default 120 BPM
 
-		if ((status & 0xF0) == 0x90 && vel > 0) { // Note on
-			if (self->pressed.contains(*mapped)) // If it's already pressed, return.
-				return;
+		for (const auto& tc : changes) {
+			const auto& last = segments.back();
+			segments.push_back({tc.tick, tc.tempo, At(last, tc.tick)});
+		}
+	}
 
-			// Add it to the list of pressed keys, and press it.
-			self->pressed.insert(*mapped);
-			self->emitter.SendKey(*mapped, true);
+	// Convert an absolute tick position to microseconds using the global tempo map.
+	// This ensures all tracks share the same tempo changes, fixing multi-track timing.
+	uint64_t TickToUs(uint32_t tick) const {
+		return At(segments[Find(tick)], tick);
+	}
 
-		} else if (((status & 0xF0) == 0x80) || ((status & 0xF0) == 0x90 && vel == 0)) { // Note off.
-			if (!self->pressed.contains(*mapped)) // If it's not pressed, return.
-				return;
+private:
+	// From `tick` onwards `tempo` applies, and `us` is the time at `tick`.
+	struct Segment {
+		uint32_t tick;
+		uint32_t tempo;
+		uint64_t us;
+	};
 
-			// Remove it from the list of pressed keys, and unpress it.
-			self->pressed.erase(*mapped);
-			self->emitter.SendKey(*mapped, false);
-		}
+	std::vector<Segment> segments;
+	uint16_t tpqn;
+
+	// The last segment starting at or before the tick. There's always the default one at tick 0, so never fails.
+	size_t Find(uint32_t tick) const {
+		auto it = std::ranges::upper_bound(segments, tick, {}, &Segment::tick);
+		return (size_t)(it - segments.begin()) - 1;
 	}
 
+	uint64_t At(const Segment& seg, uint32_t tick) const {
+		return seg.us + (uint64_t)(tick - seg.tick) * seg.tempo / tpqn;
+	}
+};
 
-public:
-	MidiLiveInput(MidiMapper& mapper, KeyboardEmitter& emitter, bool compress, int transpose) : mapper(mapper), emitter(emitter), compress(compress), transpose(transpose) {}
+// Which parts of a file get played, e.g. everything but the drums (channel 10), or just the melody track.
+// Applied while decoding, so anything filtered out never gets stored, let alone turned into keys.
+// Channels & tracks count from 1 here, like every MIDI program shows them.
+struct NoteFilter {
+	struct Range {
+		uint32_t first;
+		uint32_t last;
 
-	void Start(HWND statusHwnd) {
-		// If there are no MIDI devices attached, we can't get midi input. Crazy. Crazy? I was-
-		if (midiInGetNumDevs() == 0)
-			throw MidiDeviceException("No MIDI devices");
+		bool operator==(const Range&) const = default;
+	};
 
-		// Something up with the Midi device. I don't really care what. Not my problem.
-		if (midiInOpen(&handle, 0, (DWORD_PTR)&Callback, (DWORD_PTR)this, CALLBACK_FUNCTION) != MMSYSERR_NOERROR)
-			throw MidiDeviceException("Failed to open MIDI device");
+	uint16_t channels = 0xFFFF;    // Bit n plays channel n + 1.
+	std::vector<Range> tracks;     // Only these tracks. Empty is all of them.
+	std::vector<Range> skipTracks; // Never these, even if they're in `tracks`.
 
-		// Get the min and max, for if we compress
-		min = mapper.GetExtremeValue([](int a, int b) {return a < b; });
-		max = mapper.GetExtremeValue([](int a, int b) {return a > b; });
+	bool operator==(const NoteFilter&) const = default;
 
-		// GO GO GO
-		// Start listening to midi input.
-		midiInStart(handle);
+	// Takes the MTrk chunk's index, from 0.
+	bool PlaysTrack(size_t index) const {
+		auto in = [number = index + 1](const std::vector<Range>& ranges) {
+			return std::ranges::any_of(ranges, [&](const Range& r) { return number >= r.first && number <= r.last; });
+		};
+		return (tracks.empty() || in(tracks)) && !in(skipTracks);
+	}
+
+	// For the cache key. Two filters that play the same thing but are written differently just get cached twice, no biggie.
+	uint64_t Hash() const {
+		std::vector<uint32_t> words{channels, (uint32_t)tracks.size()};
+		for (const auto* ranges : {&tracks, &skipTracks}) {
+			for (const Range& r : *ranges)
+				words.insert(words.end(), {r.first, r.last});
+		}
+		return HashBytes({reinterpret_cast<const uint8_t*>(words.data()), words.size() * sizeof(uint32_t)});
+	}
 
-		SetWindowTextA(statusHwnd, "Listening for MIDI input...");
+	// "1-4, 6" plays just those, "!10" plays everything but 10, and they mix: "1-4, !3". Blank is everything.
+	// Throws if there's anything else in there.
+	void SetChannels(std::string_view text) {
+		std::vector<Range> include, exclude;
+		ParseList(text, 16, "channel list", include, exclude);
+
+		channels = include.empty() ? 0xFFFF : 0;
+		for (const Range& r : include)
+			channels |= (uint16_t)(((1u << r.last) - 1) & ~((1u << (r.first - 1)) - 1));
+		for (const Range& r : exclude)
+			channels &= (uint16_t)~(((1u << r.last) - 1) & ~((1u << (r.first - 1)) - 1));
 	}
 
-	void Stop(HWND statusHwnd) {
-		// Stop listening to midi input.
-		midiInStop(handle);
-		midiInClose(handle);
+	void SetTracks(std::string_view text) {
+		tracks.clear();
+		skipTracks.clear();
+		ParseList(text, UINT16_MAX, "track list", tracks, skipTracks);
+	}
+
+private:
+	static void ParseList(std::string_view text, uint32_t max, const char* what, std::vector<Range>& include, std::vector<Range>& exclude) {
+		auto trim = [](std::string_view t) {
+			while (!t.empty() && t.front() == ' ')
+				t.remove_prefix(1);
+			while (!t.empty() && t.back() == ' ')
+				t.remove_suffix(1);
+			return t;
+		};
+
+		while (!text.empty()) {
+			const size_t comma = text.find(',');
+			std::string_view item = trim(text.substr(0, comma));
+			text = comma == std::string_view::npos ? std::string_view() : text.substr(comma + 1);
 
-		SetWindowTextA(statusHwnd, "Stopped.");
+			if (item.empty())
+				continue;
 
-		// Clear the handle
-		handle = {};
+			const bool skip = item.front() == '!';
+			const std::string_view number = skip ? trim(item.substr(1)) : item;
+			const char* end = number.data() + number.size();
+
+			// "3", or "3-5".
+			Range r{};
+			auto result = std::from_chars(number.data(), end, r.first);
+			r.last = r.first;
+			if (result.ec == std::errc() && result.ptr != end && *result.ptr == '-')
+				result = std::from_chars(result.ptr + 1, end, r.last);
+
+			if (result.ec != std::errc() || result.ptr != end || r.first < 1 || r.last < r.first || r.last > max)
+				throw std::invalid_argument("Bad " + std::string(what) + ": " + std::string(item));
+
+			(skip ? exclude : include).push_back(r);
+		}
 	}
 };
 
-
-// Control IDs. have to be ints rather than HMENU to appease the linter's pointer const requirements.
-constexpr int ID_EDIT_FILE = 101;
-constexpr int ID_BTN_BROWSE = 102;
-constexpr int ID_CHK_WHITES = 103;
+class MidiFileParser {
+private:
+	// What a track reader stops on. Everything else in a track gets skipped over.
+	struct TrackEvent {
+		uint32_t tick;
+		bool isTempo;
+		uint8_t note;
+		bool noteOn;
+		uint32_t tempo; // Microseconds per quarter note, if isTempo.
+	};
+
+	// Decodes one MTrk chunk, one event at a time. Incremental, so the same code works for decoding a whole track up front
+	// and for streaming it.
+	class TrackReader {
+	private:
+		std::span<const uint8_t> track;
+		size_t at = 0;
+		uint32_t tick = 0;
+		uint8_t lastStatus = 0;
+		uint16_t channels; // Notes on channels without their bit set get skipped, as if they weren't there. 0 for tempo only.
+
+	public:
+		explicit TrackReader(std::span<const uint8_t> track, uint16_t channels = 0xFFFF) : track(track), channels(channels) {}
+
+		// The next note or tempo change. False once the track's done.
+		bool Next(TrackEvent& out) {
+			while (at < track.size()) {
+				uint32_t delta = ReadVar(track, at);
+				tick += delta;
+
+				uint8_t status = Read8(track, at);
+
+				// Running status. The byte we just read is data, so step back over it.
+				if (status < 0x80) {
+					--at;
+					status = lastStatus;
+				} else {
+					lastStatus = status;
+				}
+
+				uint8_t type = status & 0xF0;
+
+				if (type == 0x90 || type == 0x80) {
+					uint8_t note = Read8(track, at);
+					uint8_t vel = Read8(track, at);
+
+					// A status byte where the note should be. Broken file, and not a note either way, so skip it.
+					// Same for filtered out channels, minus the broken bit.
+					if ((note & 0x80) || !((channels >> (status & 0x0F)) & 1))
+						continue;
+
+					out = {tick, false, note, type == 0x90 && vel > 0, 0};
+					return true;
+				} else if (status == 0xFF) {
+					uint8_t metaType = Read8(track, at);
+					uint32_t len = ReadVar(track, at);
+
+					if (metaType == 0x51 && len == 3) {
+						Need(track, at, 3);
+						uint32_t newTempo = (track[at] << 16) | (track[at + 1] << 8) | track[at + 2];
+						at += 3;
+
+						out = {tick, true, 0, false, newTempo};
+						return true;
+					}
+
+					Skip(track, at, len);
+				} else {
+					SkipEvent(track, at, status);
+				}
+			}
+
+			return false;
+		}
+
+		// Fast path for the bulk of a black MIDI: note events in running status with a one byte delta, back to back.
+		// Each one's exactly three bytes with the top bit clear (delta, note, velocity), so once we know how many bytes in a row
+		// have the top bit clear, that many thirds are whole note events, and they don't need checking one byte at a time.
+		// Decodes as many as there are into `ticks` & `notes` (MidiEvents format), returns how many. 0 means there's nothing to store
+		// (not a run, or a run on a filtered out channel, which just gets stepped over), so use Next.
+		size_t ReadNoteRun(uint32_t* ticks, uint8_t* notes) {
+			const uint8_t type = lastStatus & 0xF0;
+			if (type != 0x90 && type != 0x80)
+				return 0;
+
+			const size_t count = DataBytes(track.data() + at, track.size() - at) / 3;
+			if (count == 0)
+				return 0;
+
+			const uint8_t* p = track.data() + at;
+
+			if (!((channels >> (lastStatus & 0x0F)) & 1)) {
+				for (size_t i = 0; i < count; ++i, p += 3)
+					tick += p[0];
+
+				at += count * 3;
+				return 0;
+			}
+
+			// Note offs as note ons with velocity 0 are by far the most common, so no branching on that either.
+			const uint8_t on = type == 0x90 ? MidiEvents::onBit : 0;
+			for (size_t i = 0; i < count; ++i, p += 3) {
+				tick += p[0];
+				ticks[i] = tick;
+				notes[i] = p[1] | (p[2] != 0 ? on : 0);
+			}
+
+			at += count * 3;
+			return count;
+		}
+	};
+
+	// How many bytes from the start of `p` have the top bit clear, i.e. are data rather than a status byte or a long delta.
+	// 32 or 16 at a time where there's SIMD: one compare of the whole block, and the first set bit of the mask is the answer.
+	static inline size_t DataBytes(const uint8_t* p, size_t n) {
+		size_t i = 0;
+
+#ifdef HEARTOPIA_AVX2
+		for (; i + 32 <= n; i += 32) {
+			const uint32_t high = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)));
+			if (high)
+				return i + std::countr_zero(high);
+		}
+#endif
+
+#ifdef HEARTOPIA_SSE2
+		for (; i + 16 <= n; i += 16) {
+			const uint32_t high = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+			if (high)
+				return i + std::countr_zero(high);
+		}
+#endif
+
+		for (; i < n; ++i) {
+			if (p[i] & 0x80)
+				return i;
+		}
+
+		return n;
+	}
+
+	// Where one MTrk chunk's notes went in the parse's arena, plus its tempo changes. Tracks don't depend on each other, so each gets its own.
+	struct TrackSlice {
+		size_t offset = 0;
+		size_t count = 0; // In tick order, since ticks only go up within a track.
+		std::vector<TempoMap::TempoChange> tempoChanges;
+	};
+
+	// Where a file's tracks live, and its timing. Found by reading only the chunk headers, so it's basically free.
+	struct Layout {
+		uint16_t tpqn; // Ticks per quarter note
+		std::vector<std::span<const uint8_t>> tracks;
+	};
+
+	// Merge order for tracks: earliest tick first, ties to the lower track, so output is deterministic.
+	// Ticks only go up within a track, and time only goes up with ticks, so this comes out in time order too.
+	// Reversed, since the std heap is a max-heap.
+	struct Head {
+		uint32_t tick;
+		size_t track;
+	};
+
+	static constexpr auto later = [](const auto& a, const auto& b) { return std::tie(a.tick, a.track) > std::tie(b.tick, b.track); };
+
+	static Layout ReadLayout(std::span<const uint8_t> data) {
+		size_t pos = 0;
+
+		// Invalid file header- not midi.
+		if (ReadString(data, pos, 4) != "MThd")
+			throw MidiFileException("Invalid MIDI header");
+
+		uint32_t headerLength = Read32(data, pos);
+		size_t headerStart = pos;
+		Read16(data, pos); // format
+		uint16_t tracks = Read16(data, pos);
+
+		Layout layout{Read16(data, pos), {}};
+
+		// Skip any extra header bytes
+		if (headerLength > 6) {
+			pos = headerStart;
+			Skip(data, pos, headerLength);
+		}
+
+		layout.tracks.reserve(tracks);
+
+		for (int tr = 0; tr < tracks; ++tr) {
+			if (ReadString(data, pos, 4) != "MTrk")
+				throw MidiFileException("Invalid track header");
+
+			auto trackLength = Read32(data, pos);
+
+			// Cut the track out as its own span, so nothing in it can read into the next track.
+			Need(data, pos, trackLength);
+			layout.tracks.push_back(data.subspan(pos, trackLength));
+			pos += trackLength;
+		}
+
+		return layout;
+	}
+
+	// Run work(i) for every i in [0, count) on a handful of threads. Each thread grabs the next index until they run out.
+	// The first exception thrown by any of them is rethrown here, once everyone's done.
+	static void ParallelFor(size_t count, auto work) {
+		size_t threadCount = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+
+		// No point spinning up a thread for one track.
+		if (threadCount <= 1) {
+			for (size_t i = 0; i < count; ++i)
+				work(i);
+			return;
+		}
+
+		std::atomic<size_t> next = 0;
+		std::exception_ptr error;
+		std::mutex errorMutex;
+
+		{
+			std::vector<std::jthread> pool;
+			pool.reserve(threadCount);
+
+			for (size_t t = 0; t < threadCount; ++t) {
+				pool.emplace_back([&] {
+					for (size_t i = next++; i < count; i = next++) {
+						try {
+							work(i);
+						} catch (...) {
+							std::scoped_lock lock(errorMutex);
+							if (!error)
+								error = std::current_exception();
+						}
+					}
+				});
+			}
+		} // Jthreads join here. I love RAII.
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	// Decode a track's notes into `ticks` & `notes`, which need room for track.size() / 3 of them. Every note event is at least 3 bytes
+	// (delta, note, velocity), so that's as many as there can possibly be. Returns how many there were.
+	// Only notes on `channels` count. The tempo changes all get read either way, since every track's timing depends on them.
+	static size_t DecodeTrack(std::span<const uint8_t> track, uint16_t channels, uint32_t* ticks, uint8_t* notes, std::vector<TempoMap::TempoChange>& tempoChanges) {
+		TrackReader reader(track, channels);
+		size_t count = 0;
+
+		// Whole runs of running status notes where there are some, one event at a time for everything else (and to get a run going).
+		for (TrackEvent e;;) {
+			if (size_t run = reader.ReadNoteRun(ticks + count, notes + count)) {
+				count += run;
+				continue;
+			}
+
+			if (!reader.Next(e))
+				break;
+
+			if (e.isTempo) {
+				tempoChanges.push_back({e.tick, e.tempo});
+			} else {
+				ticks[count] = e.tick;
+				notes[count] = e.note | (e.noteOn ? MidiEvents::onBit : 0);
+				++count;
+			}
+		}
+
+		return count;
+	}
+
+public:
+	// Decodes a file a single event at a time, in time order, for playing while it's still being parsed.
+	// Every track gets a reader, and they're k-way merged by tick. Tempo changes come out of the merge in tick order too,
+	// so they can just be applied as they go by, without needing the whole tempo map up front.
+	// Holds spans into the data, so that has to outlive it.
+	class Stream {
+	private:
+		struct ReaderHead : Head {
+			TrackEvent event;
+		};
+
+		uint16_t tpqn;
+		std::vector<TrackReader> readers;
+		std::vector<ReaderHead> heap;
+
+		// The tempo segment we're in: from `tick` onwards `tempo` applies, and `us` is the time at `tick`.
+		// Same sums as TempoMap, so both paths agree to the microsecond.
+		uint32_t segmentTick = 0;
+		uint32_t segmentTempo = 500000; // default 120 BPM
+		uint64_t segmentUs = 0;
+
+		uint64_t TickToUs(uint32_t tick) const {
+			return segmentUs + (uint64_t)(tick - segmentTick) * segmentTempo / tpqn;
+		}
+
+	public:
+		explicit Stream(std::span<const uint8_t> data, const NoteFilter& filter = {}) {
+			// Header problems throw here, right away, rather than from the middle of playback.
+			Layout layout = ReadLayout(data);
+			tpqn = layout.tpqn;
+
+			readers.reserve(layout.tracks.size());
+			for (size_t tr = 0; tr < layout.tracks.size(); ++tr)
+				readers.emplace_back(layout.tracks[tr], filter.PlaysTrack(tr) ? filter.channels : 0);
+
+			for (size_t tr = 0; tr < readers.size(); ++tr) {
+				ReaderHead head{{0, tr}, {}};
+				if (readers[tr].Next(head.event)) {
+					head.tick = head.event.tick;
+					heap.push_back(head);
+				}
+			}
+			std::ranges::make_heap(heap, later);
+		}
+
+		// The next note, in time order. False once every track's done.
+		bool Next(MidiEvent& out) {
+			while (!heap.empty()) {
+				std::ranges::pop_heap(heap, later);
+				ReaderHead& head = heap.back();
+				const TrackEvent e = head.event;
+
+				// Refill from the same track, or drop it if it's done.
+				if (readers[head.track].Next(head.event)) {
+					head.tick = head.event.tick;
+					std::ranges::push_heap(heap, later);
+				} else {
+					heap.pop_back();
+				}
+
+				if (e.isTempo) {
+					segmentUs = TickToUs(e.tick);
+					segmentTick = e.tick;
+					segmentTempo = e.tempo;
+					continue;
+				}
+
+				out = {TickToUs(e.tick) / 1000, e.note, e.noteOn};
+				return true;
+			}
+
+			return false;
+		}
+	};
+
+	// What's in a track, for picking which ones to play.
+	struct TrackInfo {
+		std::string name;      // From its track name event, if it's got one.
+		uint64_t notes = 0;    // Note ons.
+		uint16_t channels = 0; // Bit n set if it has notes on channel n + 1.
+	};
+
+	// Reads through every track without storing anything, so it's quick even on a black MIDI.
+	static std::vector<TrackInfo> Scan(std::span<const uint8_t> data) {
+		Layout layout = ReadLayout(data);
+		std::vector<TrackInfo> info(layout.tracks.size());
+
+		ParallelFor(layout.tracks.size(), [&](size_t i) {
+			const auto track = layout.tracks[i];
+			TrackInfo& out = info[i];
+			size_t at = 0;
+			uint8_t lastStatus = 0;
+
+			// Same walk as TrackReader::Next, minus the ticks.
+			while (at < track.size()) {
+				ReadVar(track, at);
+				uint8_t status = Read8(track, at);
+
+				if (status < 0x80) {
+					--at;
+					status = lastStatus;
+				} else {
+					lastStatus = status;
+				}
+
+				const uint8_t type = status & 0xF0;
+
+				if (type == 0x90 || type == 0x80) {
+					Read8(track, at);
+					if (Read8(track, at) > 0 && type == 0x90) {
+						++out.notes;
+						out.channels |= (uint16_t)(1 << (status & 0x0F));
+					}
+				} else if (status == 0xFF) {
+					const uint8_t metaType = Read8(track, at);
+					const uint32_t len = ReadVar(track, at);
+					Need(track, at, len);
+
+					if (metaType == 0x03 && out.name.empty())
+						out.name.assign(reinterpret_cast<const char*>(track.data() + at), len);
+					at += len;
+				} else {
+					SkipEvent(track, at, status);
+				}
+			}
+		});
+
+		return info;
+	}
+
+	static MidiEvents Parse(const std::string& path, const NoteFilter& filter = {}) {
+		// Step 1: Open (map) the file. The mapping has to outlive the parse, so keep it here.
+		MappedFile file(path);
+		return Parse(file.Bytes(), filter);
+	}
+
+	static MidiEvents Parse(std::span<const uint8_t> data, const NoteFilter& filter = {}) {
+		// Pre-scan: find where every track lives.
+		Layout layout = ReadLayout(data);
+
+		// One arena for every track's notes, sized from the track lengths: each track can't have more than a third of its length in notes.
+		// Each track gets its own slice, so they can all decode at once without growing or copying anything.
+		// Filtered out tracks get no room at all. They still get read for their tempo changes, but none of their notes are kept.
+		std::vector<TrackSlice> slices(layout.tracks.size());
+		std::vector<uint16_t> channels(layout.tracks.size());
+		size_t capacity = 0;
+
+		for (size_t i = 0; i < slices.size(); ++i) {
+			channels[i] = filter.PlaysTrack(i) ? filter.channels : 0;
+			slices[i].offset = capacity;
+			capacity += channels[i] ? layout.tracks[i].size() / 3 : 0;
+		}
+
+		MidiEvents raw(capacity);
+		uint32_t* rawTicks = raw.Times();
+		uint8_t* rawNotes = raw.Notes();
+
+		ParallelFor(layout.tracks.size(), [&](size_t i) {
+			slices[i].count = DecodeTrack(layout.tracks[i], channels[i], rawTicks + slices[i].offset, rawNotes + slices[i].offset, slices[i].tempoChanges);
+		});
+
+		// Build the global tempo map once, now that every track's tempo changes are known.
+		// Gathered in track order, so the stable sort in TempoMap keeps ties in file order.
+		std::vector<TempoMap::TempoChange> tempoChanges;
+		size_t eventCount = 0;
+		size_t noteTracks = 0;
+
+		for (const auto& slice : slices) {
+			tempoChanges.insert(tempoChanges.end(), slice.tempoChanges.begin(), slice.tempoChanges.end());
+			eventCount += slice.count;
+			noteTracks += slice.count > 0;
+		}
+
+		const TempoMap tempoMap(std::move(tempoChanges), layout.tpqn);
+		TempoMap::Cursor cursor(tempoMap);
+
+		// Microseconds to whole milliseconds, clamped rather than wrapped for the 49 day long songs.
+		auto toMs = [&](uint32_t tick) { return (uint32_t)std::min<uint64_t>(cursor.TickToUs(tick) / 1000, UINT32_MAX); };
+
+		// Only one track with notes in it (format 0, or just the one instrument)? Then it's already in order, so convert it in place.
+		// Slides down to the start of the arena as it goes. Reads are always at or ahead of writes, so nothing gets trodden on.
+		if (noteTracks <= 1) {
+			const auto slice = std::ranges::find_if(slices, [](const TrackSlice& s) { return s.count > 0; });
+			if (slice != slices.end()) {
+				for (size_t i = 0; i < slice->count; ++i) {
+					rawTicks[i] = toMs(rawTicks[slice->offset + i]);
+					rawNotes[i] = rawNotes[slice->offset + i];
+				}
+			}
+
+			raw.SetSize(eventCount);
+			return raw;
+		}
+
+		// Every track is already sorted, so instead of sorting everything, k-way merge them: O(n log k), k being tracks.
+		// The merge comes out in tick order, so one cursor converts the lot while only ever walking forwards.
+		std::vector<size_t> next(slices.size(), 0);
+		std::vector<Head> heap;
+		heap.reserve(slices.size());
+
+		for (size_t tr = 0; tr < slices.size(); ++tr) {
+			if (slices[tr].count > 0)
+				heap.push_back({rawTicks[slices[tr].offset], tr});
+		}
+		std::ranges::make_heap(heap, later);
+
+		MidiEvents events(eventCount);
+		uint32_t* times = events.Times();
+		uint8_t* notes = events.Notes();
+
+		for (size_t n = 0; !heap.empty(); ++n) {
+			std::ranges::pop_heap(heap, later);
+			Head& head = heap.back();
+
+			const TrackSlice& slice = slices[head.track];
+			const size_t at = slice.offset + next[head.track]++;
+			times[n] = toMs(rawTicks[at]);
+			notes[n] = rawNotes[at];
+
+			// Refill from the same track, or drop it if it's done.
+			if (next[head.track] < slice.count) {
+				head.tick = rawTicks[at + 1];
+				std::ranges::push_heap(heap, later);
+			} else {
+				heap.pop_back();
+			}
+		}
+
+		events.SetSize(eventCount);
+		return events;
+	}
+
+private:
+	// Every read goes through here first. Running off the end of the data means a truncated or lying file.
+	static inline void Need(std::span<const uint8_t> d, size_t pos, size_t n) {
+		if (d.size() - pos < n)
+			throw MidiFileException("Unexpected end of MIDI data");
+	}
+
+	static inline void Skip(std::span<const uint8_t> d, size_t& pos, size_t n) {
+		Need(d, pos, n);
+		pos += n;
+	}
+
+	static inline uint8_t Read8(std::span<const uint8_t> d, size_t& pos) {
+		Need(d, pos, 1);
+		return d[pos++];
+	}
+
+	static inline uint32_t ReadVar(std::span<const uint8_t> d, size_t& pos) {
+		uint32_t value = 0;
+
+		// OKAY, so
+		// If the first bit is 1, more data follows. Otherwise, this is the end. 
+		// It's also only up to 4 bytes in length, so we add a hard limit there, too.
+		// If this is data, shift it & add the 7 right bits.
+		// (value = value * 128 + next 7 bits)
+		for (int i = 0; i < 4; ++i) {  // MIDI VLQ max 4 bytes
+			uint8_t c = Read8(d, pos);
+			value = (value << 7) | (c & 0x7F);
+
+			if (!(c & 0x80)) // End!
+				return value;
+		}
+
+		// Bruh
+		return value;
+	}
+
+	static inline uint32_t Read32(std::span<const uint8_t> d, size_t& pos) {
+		// Read 4 bytes in big-endian order (MIDI standard)
+		Need(d, pos, 4);
+		const uint8_t* b = d.data() + pos;
+		pos += 4;
+		return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+	}
+
+
+	static inline uint16_t Read16(std::span<const uint8_t> d, size_t& pos) {
+		// Read 2 bytes in big-endian order (MIDI standard)
+		Need(d, pos, 2);
+		const uint8_t* b = d.data() + pos;
+		pos += 2;
+		return (uint16_t(b[0]) << 8) | uint16_t(b[1]);
+	}
+
+	static inline std::string_view ReadString(std::span<const uint8_t> d, size_t& pos, size_t n) {
+		// Erm... Pretty straightforward.
+		// String. Read. Return. It's a view into the file now, so no copy either.
+		Need(d, pos, n);
+		std::string_view s(reinterpret_cast<const char*>(d.data() + pos), n);
+		pos += n;
+		return s;
+	}
+
+	static void SkipEvent(std::span<const uint8_t> d, size_t& pos, uint8_t status) {
+		/*
+		Status contains the event type. One of the following:
+		- 0x80 Note Off
+		- 0x90 Note On
+		- 0xA0 Polyphonic key pressure
+		- 0xB0 Control Change
+		- 0xC0 Program Change
+		- 0xD0 Channel pressure
+		- 0xE0 Pitch bend
+		*/
+
+		// Get top 4 bits of the status.
+		uint8_t type = status & 0xF0;
+
+		// Program Change or Channel pressure. Skip 1.
+		if (type == 0xC0 || type == 0xD0)
+			Skip(d, pos, 1);
+
+		// Polyphonic key pressure, Control Change, or Pitch bend. Skip 2.
+		else if (type == 0xA0 || type == 0xB0 || type == 0xE0)
+			Skip(d, pos, 2);
+
+		// Meta event
+		else if (status == 0xFF) {
+			Read8(d, pos); // Meta type
+			Skip(d, pos, ReadVar(d, pos));
+		}
+
+		// System something or-rather. Check the length, then skip the length.
+		else if (status == 0xF0 || status == 0xF7)
+			Skip(d, pos, ReadVar(d, pos));
+	}
+};
+
+// Small function to make a number fit in a range.
+int Compress(int note, int min, int max) {
+	if (note < min)
+		while (note < min)
+			note += 12;
+	else while (note > max)
+		note -= 12;
+
+	return note;
+}
+
+// One keystroke of a compiled schedule. Packed to 8 bytes, since long songs have a LOT of these.
+struct ScheduledKey {
+	uint32_t timeMs; // 49 days of song should be enough for anyone.
+	KeyStroke key;
+};
+static_assert(sizeof(ScheduledKey) == 8);
+
+// Which keys are down, by physical key (scancode, plus the extended bit), so two VKs on one key count as one.
+// Plus what to send to press each of them again, for pausing & seeking.
+class KeyboardState {
+public:
+	static constexpr size_t keyCount = 512;
+
+	static size_t Index(KeyStroke key) {
+		return (key.scanCode & 0xFF) | ((key.flags & KEYEVENTF_EXTENDEDKEY) ? 0x100 : 0);
+	}
+
+	std::bitset<keyCount> down;
+
+private:
+	std::array<KeyStroke, keyCount> presses{};
+
+public:
+	// Keep track of a key that just went out.
+	void Apply(KeyStroke key) {
+		const size_t i = Index(key);
+		down[i] = !(key.flags & KEYEVENTF_KEYUP);
+
+		key.flags &= ~KEYEVENTF_KEYUP;
+		presses[i] = key;
+	}
+
+	// Keystrokes to let go of everything that's down.
+	void Releases(std::vector<KeyStroke>& out) const {
+		for (size_t i = 0; i < keyCount; ++i) {
+			if (down[i])
+				out.push_back({presses[i].scanCode, (WORD)(presses[i].flags | KEYEVENTF_KEYUP)});
+		}
+	}
+
+	// Keystrokes to press everything that's down again.
+	void Presses(std::vector<KeyStroke>& out) const {
+		for (size_t i = 0; i < keyCount; ++i) {
+			if (down[i])
+				out.push_back(presses[i]);
+		}
+	}
+};
+
+// Lets playback jump anywhere in a compiled schedule: a binary search for where, and a snapshot of which keys
+// should be held there. Snapshots are every `checkpointEvery` keys (64 bytes each), so working out what's held
+// only ever replays a few hundred keys, instead of the whole song up to that point.
+// Holds a reference to the schedule, so that has to outlive it.
+class ScheduleIndex {
+private:
+	static constexpr size_t checkpointEvery = 1024;
+
+	std::span<const ScheduledKey> keys;
+	std::vector<std::bitset<KeyboardState::keyCount>> checkpoints; // What's down right BEFORE key n * checkpointEvery.
+	KeyboardState everything; // Every key the song touches, so the snapshots can be turned back into keystrokes.
+
+public:
+	explicit ScheduleIndex(std::span<const ScheduledKey> keys) : keys(keys) {
+		checkpoints.reserve(keys.size() / checkpointEvery + 1);
+
+		for (size_t i = 0; i < keys.size(); ++i) {
+			if (i % checkpointEvery == 0)
+				checkpoints.push_back(everything.down);
+
+			everything.Apply(keys[i].key);
+		}
+	}
+
+	// First key at or after `timeMs`.
+	size_t Find(uint32_t timeMs) const {
+		auto it = std::ranges::lower_bound(keys, timeMs, {}, &ScheduledKey::timeMs);
+		return it - keys.begin();
+	}
+
+	// Which keys are down just before key `pos` goes out.
+	KeyboardState HeldAt(size_t pos) const {
+		KeyboardState held = everything;
+		held.down.reset();
+
+		if (checkpoints.empty())
+			return held;
+
+		pos = std::min(pos, keys.size());
+		const size_t checkpoint = std::min(pos / checkpointEvery, checkpoints.size() - 1);
+
+		held.down = checkpoints[checkpoint];
+		for (size_t i = checkpoint * checkpointEvery; i < pos; ++i)
+			held.Apply(keys[i].key);
+
+		return held;
+	}
+
+	uint32_t DurationMs() const {
+		return keys.empty() ? 0 : keys.back().timeMs;
+	}
+};
+
+
+// Turns parsed MIDI events into keystrokes, ahead of time.
+// Mapping, transposing & compressing are all fixed for a whole play, so there's no reason to redo them per event while playing.
+class ScheduleCompiler {
+public:
+	// How many notes are holding down each VK, as of wherever compiling has got to. One per pass through a song.
+	// Two tracks on one note (or two octaves compressed onto one key) would otherwise press it twice, then let go
+	// when the FIRST one ends, while the other's still meant to be held.
+	struct HeldKeys {
+		std::array<uint16_t, 256> notes{};
+		uint64_t collapsedPresses = 0; // Only counted when collapsing.
+		uint64_t collapsedReleases = 0;
+	};
+
+private:
+	const MidiMapper& mapper;
+	const KeyboardEmitter& emitter;
+	int transpose;
+	bool compress;
+	bool collapse;
+	int min;
+	int max;
+
+public:
+	// `collapse`: a note landing on a key that's already down gets dropped, instead of let go & pressed again.
+	ScheduleCompiler(const MidiMapper& mapper, const KeyboardEmitter& emitter, int transpose, bool compress, bool collapse = false)
+		: mapper(mapper), emitter(emitter), transpose(transpose), compress(compress), collapse(collapse), min(mapper.Min()), max(mapper.Max()) {}
+
+	// The keystrokes for an event, appended to `out`. Usually one, none if the note doesn't map to a key
+	// (or is just another note on a key that's being held), and two for a retrigger.
+	void Compile(const MidiEvent& e, HeldKeys& held, std::vector<ScheduledKey>& out) const {
+		// Transpose the note
+		int note = e.note + transpose;
+
+		auto mapped = mapper.MapNote(note);
+
+		// Doesn't fit? Squish it into range and try again, if we're allowed to.
+		if (!mapped.has_value() && compress)
+			mapped = mapper.MapNote(Compress(note, min, max));
+
+		if (!mapped.has_value())
+			return;
+
+		const uint32_t timeMs = (uint32_t)e.timeMs;
+		uint16_t& count = held.notes[*mapped & 0xFF];
+
+		if (e.noteOn) {
+			// Already down? Let go and press it again, so you can actually hear the new note (one SendInput, same chord).
+			if (count++ > 0) {
+				if (collapse) {
+					++held.collapsedPresses;
+					return;
+				}
+
+				out.push_back({timeMs, emitter.Resolve(*mapped, false)});
+			}
+
+			out.push_back({timeMs, emitter.Resolve(*mapped, true)});
+			return;
+		}
+
+		// Stray note off. Nothing's holding the key, so nothing to let go of.
+		if (count == 0)
+			return;
+
+		// Only let go once the last note holding it does.
+		if (--count > 0) {
+			if (collapse)
+				++held.collapsedReleases;
+			return;
+		}
+
+		out.push_back({timeMs, emitter.Resolve(*mapped, false)});
+	}
+
+	// Compile a whole song. Unmappable notes get dropped here, so playback never even sees them.
+	std::vector<ScheduledKey> Compile(const MidiEvents& events, HeldKeys* stats = nullptr) const {
+		std::vector<ScheduledKey> keys;
+		keys.reserve(events.size());
+
+		HeldKeys held;
+		for (size_t i = 0; i < events.size(); ++i)
+			Compile(events[i], held, keys);
+
+		if (stats)
+			*stats = held;
+
+		return keys;
+	}
+};
+
+
+// How hard to thin out a song. Black MIDIs throw thousands of presses a second at the same few keys,
+// and the game just drops them (and lags while it's at it).
+struct ThinSettings {
+	bool enabled = false;
+	int maxKeys = 0;  // Most keys held at once. 0 for no limit.
+	int minGapMs = 0; // Shortest time between two presses of one key. 0 for no limit.
+
+	bool operator==(const ThinSettings&) const = default;
+};
+
+// What got thrown out, and why.
+struct ThinStats {
+	uint64_t total = 0;      // Keys that came in.
+	uint64_t duplicates = 0; // Presses of a key that was already down.
+	uint64_t polyphony = 0;  // Presses past the key limit.
+	uint64_t retrigger = 0;  // Presses too soon after the last one.
+	uint64_t releases = 0;   // Releases that went along with any of the above.
+
+	uint64_t Removed() const { return duplicates + polyphony + retrigger + releases; }
+};
+
+// Filters a compiled schedule, in order. Same idea as the live input: a key goes down with the first note on it,
+// and up with the last one, and everything in between is dropped.
+// On top of that it can cap how many keys are down at once, and how fast a key can be hit again.
+class ScheduleThinner {
+private:
+	ThinSettings settings;
+	ThinStats stats;
+
+	// Per physical key, same as KeyboardState.
+	static constexpr size_t keyCount = KeyboardState::keyCount;
+	std::array<uint16_t, keyCount> notes{};   // How many notes are on for the key, kept or not.
+	std::bitset<keyCount> down;               // Whether we actually pressed it.
+	std::bitset<keyCount> pressed;            // Whether it's ever been pressed, so lastPress means something.
+	std::array<uint32_t, keyCount> lastPress{};
+	int held = 0;
+
+public:
+	explicit ScheduleThinner(const ThinSettings& settings) : settings(settings) {}
+
+	// Whether a key should stay in the schedule. Must be fed every key, in order.
+	bool Accept(const ScheduledKey& k) {
+		if (!settings.enabled)
+			return true;
+
+		++stats.total;
+		const size_t i = KeyboardState::Index(k.key);
+
+		if (!(k.key.flags & KEYEVENTF_KEYUP)) {
+			++notes[i];
+
+			if (down[i]) {
+				++stats.duplicates;
+				return false;
+			}
+
+			if (settings.minGapMs > 0 && pressed[i] && k.timeMs >= lastPress[i] && k.timeMs - lastPress[i] < (uint32_t)settings.minGapMs) {
+				++stats.retrigger;
+				return false;
+			}
+
+			if (settings.maxKeys > 0 && held >= settings.maxKeys) {
+				++stats.polyphony;
+				return false;
+			}
+
+			down[i] = true;
+			pressed[i] = true;
+			lastPress[i] = k.timeMs;
+			++held;
+			return true;
+		}
+
+		if (notes[i] > 0)
+			--notes[i];
+
+		// Only let go once the last note holding it does. And never let go of something we didn't press.
+		if (!down[i] || notes[i] > 0) {
+			++stats.releases;
+			return false;
+		}
+
+		down[i] = false;
+		--held;
+		return true;
+	}
+
+	// Thin a whole schedule, in place.
+	void Thin(std::vector<ScheduledKey>& keys) {
+		std::erase_if(keys, [&](const ScheduledKey& k) { return !Accept(k); });
+	}
+
+	// Overlapping notes the compiler collapsed (see ScheduleCompiler::HeldKeys). They count as thinned too.
+	void AddCollapsed(const ScheduleCompiler::HeldKeys& held) {
+		stats.total += held.collapsedPresses + held.collapsedReleases;
+		stats.duplicates += held.collapsedPresses;
+		stats.releases += held.collapsedReleases;
+	}
+
+	const ThinStats& Stats() const { return stats; }
+
+	// Status line bit, like "thinned 1234 of 5678 keys (...)".
+	std::string Summary() const {
+		char buf[160];
+		snprintf(buf, sizeof(buf), "thinned %llu of %llu keys (%llu repeats, %llu over limit, %llu too fast)",
+			(unsigned long long)stats.Removed(), (unsigned long long)stats.total, (unsigned long long)stats.duplicates,
+			(unsigned long long)stats.polyphony, (unsigned long long)stats.retrigger);
+		return buf;
+	}
+};
+
+
+// Bounded, blocking queue between two threads. Not lock-free, since it never goes anywhere near a driver callback,
+// but bounded, so a fast producer can't run off with all the memory.
+template <typename T>
+class BoundedQueue {
+private:
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	// Waits while full. False if the queue got closed, in which case nobody wants the item anymore.
+	bool Push(T item) {
+		std::unique_lock lock(mutex);
+		notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+
+		if (closed)
+			return false;
+
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// Waits while empty. Nothing once it's closed and everything's been taken out.
+	std::optional<T> Pop() {
+		std::unique_lock lock(mutex);
+		notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+
+		if (items.empty())
+			return std::nullopt;
+
+		T item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return item;
+	}
+
+	// No more pushing. Wakes up everyone waiting on either side.
+	void Close() {
+		{
+			std::scoped_lock lock(mutex);
+			closed = true;
+		}
+
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+};
+
+// Streams a file's compiled schedule: a producer thread decodes, converts & compiles in time order,
+// and hands it over in chunks through a bounded queue. The first note doesn't wait on the whole file,
+// and however big the file is, only a few chunks are ever in memory.
+// Holds spans into the data, so that has to outlive it.
+class ScheduleStream {
+public:
+	using Chunk = std::vector<ScheduledKey>;
+
+private:
+	// Roughly how many keys go in a chunk, and how many chunks can be waiting. ~64KB in flight, tops.
+	static constexpr size_t chunkSize = 512;
+	static constexpr size_t chunksAhead = 16;
+
+	BoundedQueue<Chunk> queue{chunksAhead};
+	std::exception_ptr error; // Set by the producer before it closes the queue, read by the consumer after.
+	ScheduleThinner thinner; // Producer only, until it closes the queue.
+	MidiFileParser::Stream stream;
+	std::jthread producer; // Last, so it's stopped (joined) before anything it uses goes away.
+
+	void Produce(ScheduleCompiler compiler) {
+		try {
+			Chunk chunk;
+			chunk.reserve(chunkSize);
+
+			ScheduleCompiler::HeldKeys held;
+			std::vector<ScheduledKey> keys; // What one event compiled to. Two at most.
+
+			for (MidiEvent e; stream.Next(e);) {
+				keys.clear();
+				compiler.Compile(e, held, keys);
+
+				for (const auto& key : keys) {
+					if (!thinner.Accept(key))
+						continue;
+
+					// Only cut a chunk between milliseconds, so a chord never gets split across two.
+					if (chunk.size() >= chunkSize && chunk.back().timeMs != key.timeMs) {
+						if (!queue.Push(std::move(chunk)))
+							return; // Consumer's gone. Stopped, probably.
+
+						chunk = {};
+						chunk.reserve(chunkSize);
+					}
+
+					chunk.push_back(key);
+				}
+			}
+
+			thinner.AddCollapsed(held);
+
+			if (!chunk.empty())
+				queue.Push(std::move(chunk));
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		queue.Close();
+	}
+
+public:
+	// Header errors throw right here. Anything later in the file comes out of Next.
+	ScheduleStream(std::span<const uint8_t> data, const ScheduleCompiler& compiler, const ThinSettings& thin, const NoteFilter& filter)
+		: thinner(thin), stream(data, filter) {
+		producer = std::jthread([this, compiler] { Produce(compiler); });
+	}
+
+	~ScheduleStream() {
+		// Unblocks the producer if it's waiting on a full queue. Then the jthread joins it.
+		queue.Close();
+	}
+
+	ScheduleStream(const ScheduleStream&) = delete;
+	ScheduleStream& operator=(const ScheduleStream&) = delete;
+
+	// The next chunk of keys, in time order. Nothing once the song's over. Rethrows if the producer hit a bad file.
+	std::optional<Chunk> Next() {
+		auto chunk = queue.Pop();
+
+		if (!chunk.has_value() && error)
+			std::rethrow_exception(error);
+
+		return chunk;
+	}
+
+	// What the thinner threw out. Only complete once Next has run dry.
+	const ScheduleThinner& Thinner() const {
+		return thinner;
+	}
+};
+
+
+// What a compiled schedule depends on: the file's contents, and every setting that changes what keys come out.
+// The keyboard layout's in there since scancodes depend on it.
+struct SongCacheKey {
+	uint64_t contentHash = 0;
+	uint64_t keyboardLayout = 0;
+	uint64_t noteLayout = 0; // Hash of the note -> key table.
+	int32_t transpose = 0;
+	bool compress = false;
+	ThinSettings thin;
+	uint64_t noteFilter = 0; // NoteFilter::Hash.
+
+	bool operator==(const SongCacheKey&) const = default;
+};
+
+// Compiled schedules of recently played songs, so replaying one skips parsing altogether.
+// Least recently used gets kicked out. Only a handful of entries, so a list is plenty (no hashing needed).
+// Can be used from any thread.
+class SongCache {
+public:
+	using Schedule = std::shared_ptr<const std::vector<ScheduledKey>>;
+
+private:
+	static constexpr size_t capacity = 8;
+
+	std::mutex mutex;
+	std::list<std::pair<SongCacheKey, Schedule>> entries; // Most recently used at the front.
+
+public:
+	Schedule Find(const SongCacheKey& key) {
+		std::scoped_lock lock(mutex);
+
+		auto it = std::ranges::find(entries, key, &std::pair<SongCacheKey, Schedule>::first);
+		if (it == entries.end())
+			return nullptr;
+
+		// Bump it to the front.
+		entries.splice(entries.begin(), entries, it);
+		return it->second;
+	}
+
+	void Insert(const SongCacheKey& key, Schedule schedule) {
+		std::scoped_lock lock(mutex);
+
+		std::erase_if(entries, [&](const auto& entry) { return entry.first == key; });
+		entries.emplace_front(key, std::move(schedule));
+
+		if (entries.size() > capacity)
+			entries.pop_back();
+	}
+
+	// The on-disk copy lives next to the .mid.
+	static std::string DiskPath(const std::string& midiPath) {
+		return midiPath + ".hmpcache";
+	}
+
+	// On-disk format: a fixed header, then the ScheduledKey array as-is.
+	// Loads with one mapping and a copy. If the key doesn't match (file changed, settings changed), it's just ignored.
+	static Schedule Load(const std::string& path, const SongCacheKey& key) {
+		try {
+			MappedFile file(path);
+			auto bytes = file.Bytes();
+
+			DiskHeader header{};
+			if (bytes.size() < sizeof(header))
+				return nullptr;
+			memcpy(&header, bytes.data(), sizeof(header));
+
+			if (memcmp(header.magic, "HMPC", 4) != 0 || header.version != diskVersion || !(header.Key() == key))
+				return nullptr;
+
+			if (bytes.size() - sizeof(header) != header.count * sizeof(ScheduledKey))
+				return nullptr;
+
+			auto schedule = std::make_shared<std::vector<ScheduledKey>>(header.count);
+			memcpy(schedule->data(), bytes.data() + sizeof(header), header.count * sizeof(ScheduledKey));
+			return schedule;
+		} catch (const std::exception&) {
+			// No cache file (or can't read it). Not an error, just a miss.
+			return nullptr;
+		}
+	}
+
+	static bool Save(const std::string& path, const SongCacheKey& key, const std::vector<ScheduledKey>& schedule) {
+		DiskHeader header{};
+		memcpy(header.magic, "HMPC", 4);
+		header.version = diskVersion;
+		header.contentHash = key.contentHash;
+		header.keyboardLayout = key.keyboardLayout;
+		header.noteLayout = key.noteLayout;
+		header.transpose = key.transpose;
+		header.compress = key.compress;
+		header.thinEnabled = key.thin.enabled;
+		header.thinMaxKeys = key.thin.maxKeys;
+		header.thinMinGapMs = key.thin.minGapMs;
+		header.noteFilter = key.noteFilter;
+		header.count = schedule.size();
+
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(schedule.data()), schedule.size() * sizeof(ScheduledKey));
+		return (bool)out;
+	}
+
+private:
+	static constexpr uint32_t diskVersion = 4;
+
+	struct DiskHeader {
+		char magic[4];
+		uint32_t version;
+		uint64_t contentHash;
+		uint64_t keyboardLayout;
+		uint64_t noteLayout;
+		int32_t transpose;
+		uint8_t reserved;
+		uint8_t compress;
+		uint8_t thinEnabled;
+		uint8_t reserved2;
+		uint64_t count;
+		int32_t thinMaxKeys;
+		int32_t thinMinGapMs;
+		uint64_t noteFilter;
+
+		SongCacheKey Key() const {
+			return {contentHash, keyboardLayout, noteLayout, transpose, compress != 0, {thinEnabled != 0, thinMaxKeys, thinMinGapMs}, noteFilter};
+		}
+	};
+	static_assert(sizeof(DiskHeader) == 64);
+};
+
+
+// A compiled schedule saved on its own, ready to play (or hand to someone else) without the .mid.
+// Plays straight out of the mapped file: no parsing, no compiling, so a black MIDI starts as fast as a tiny one.
+//
+// Layout, struct-of-arrays after a fixed header:
+//   Header
+//   deltas[deltaBytes]  ms since the previous key, LEB128 varints. Chords are all 0s, so mostly one byte each.
+//   scanCodes[count]    low byte of each key's scancode
+//   flags[count]        each key's KEYEVENTF_* bits (they all fit in a byte)
+//
+// Scancodes come from whatever keyboard layout it was exported on, same as everywhere else.
+class SongPack {
+private:
+	static constexpr uint32_t version = 1;
+
+	struct Header {
+		char magic[4];
+		uint32_t version;
+		uint64_t count;
+		uint64_t deltaBytes;
+		uint32_t durationMs;
+		uint32_t reserved;
+		uint64_t keyboardLayout; // Just informational, for now.
+	};
+	static_assert(sizeof(Header) == 40);
+
+	Header header{};
+	std::span<const uint8_t> deltas;
+	std::span<const uint8_t> scanCodes;
+	std::span<const uint8_t> flags;
+
+public:
+	// Is this a song pack, rather than a MIDI file?
+	static bool IsPack(std::span<const uint8_t> data) {
+		return data.size() >= 4 && memcmp(data.data(), "HMPS", 4) == 0;
+	}
+
+	// Holds spans into the data, so that has to outlive it.
+	explicit SongPack(std::span<const uint8_t> data) {
+		if (data.size() < sizeof(Header) || !IsPack(data))
+			throw MidiFileException("Invalid song pack");
+		memcpy(&header, data.data(), sizeof(Header));
+
+		if (header.version != version)
+			throw MidiFileException("Unsupported song pack version");
+
+		// Sections have to add up to exactly the file. Checked with subtraction, so silly sizes can't overflow.
+		const uint64_t body = data.size() - sizeof(Header);
+		if (header.deltaBytes > body || (body - header.deltaBytes) / 2 != header.count || (body - header.deltaBytes) % 2 != 0)
+			throw MidiFileException("Invalid song pack");
+
+		deltas = data.subspan(sizeof(Header), header.deltaBytes);
+		scanCodes = data.subspan(sizeof(Header) + header.deltaBytes, header.count);
+		flags = data.subspan(sizeof(Header) + header.deltaBytes + header.count, header.count);
+	}
+
+	uint64_t Count() const { return header.count; }
+	uint32_t DurationMs() const { return header.durationMs; }
+
+	// Decodes a pack a chunk at a time, for playing.
+	class Reader {
+	private:
+		const SongPack& pack;
+		size_t deltaPos = 0;
+		size_t index = 0;
+		uint32_t timeMs = 0;
+
+	public:
+		explicit Reader(const SongPack& pack) : pack(pack) {}
+
+		// Fills `out` with about `chunkSize` keys. Only cuts between milliseconds, so a chord never gets split.
+		// False once there's nothing left.
+		bool Next(std::vector<ScheduledKey>& out, size_t chunkSize = 512) {
+			out.clear();
+
+			while (index < pack.header.count) {
+				// Full, and the next key isn't part of this chord? Stop here. (A 0 delta is always just one 0 byte.)
+				if (out.size() >= chunkSize && deltaPos < pack.deltas.size() && pack.deltas[deltaPos] != 0)
+					break;
+
+				// LEB128
+				uint32_t delta = 0;
+				for (int shift = 0;; shift += 7) {
+					if (deltaPos >= pack.deltas.size() || shift > 28)
+						throw MidiFileException("Invalid song pack");
+
+					uint8_t b = pack.deltas[deltaPos++];
+					delta |= (uint32_t)(b & 0x7F) << shift;
+					if (!(b & 0x80))
+						break;
+				}
+
+				timeMs += delta;
+				out.push_back({timeMs, KeyStroke{pack.scanCodes[index], pack.flags[index]}});
+				++index;
+			}
+
+			return !out.empty();
+		}
+	};
+
+	static bool Save(const std::string& path, std::span<const ScheduledKey> keys, HKL keyboardLayout) {
+		Header header{};
+		memcpy(header.magic, "HMPS", 4);
+		header.version = version;
+		header.count = keys.size();
+		header.keyboardLayout = (uint64_t)(uintptr_t)keyboardLayout;
+
+		std::vector<uint8_t> deltaBytes;
+		std::vector<uint8_t> scanBytes(keys.size());
+		std::vector<uint8_t> flagBytes(keys.size());
+		deltaBytes.reserve(keys.size() + keys.size() / 4);
+
+		uint32_t last = 0;
+		for (size_t i = 0; i < keys.size(); ++i) {
+			uint32_t delta = keys[i].timeMs - last;
+			last = keys[i].timeMs;
+
+			do {
+				uint8_t b = delta & 0x7F;
+				delta >>= 7;
+				deltaBytes.push_back(delta ? (b | 0x80) : b);
+			} while (delta);
+
+			scanBytes[i] = (uint8_t)keys[i].key.scanCode;
+			flagBytes[i] = (uint8_t)keys[i].key.flags;
+		}
+
+		header.deltaBytes = deltaBytes.size();
+		header.durationMs = last;
+
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(deltaBytes.data()), deltaBytes.size());
+		out.write(reinterpret_cast<const char*>(scanBytes.data()), scanBytes.size());
+		out.write(reinterpret_cast<const char*>(flagBytes.data()), flagBytes.size());
+		return (bool)out;
+	}
+};
+
+
+// Raw QPC ticks. The cheapest accurate "now" Windows has. Safe to call from anywhere, it's just a counter read.
+inline int64_t QpcNow() {
+	LARGE_INTEGER now{};
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+// QPC ticks to microseconds. The frequency's fixed at boot, so ask once.
+inline int64_t QpcToUs(int64_t ticks) {
+	static const int64_t frequency = [] { LARGE_INTEGER f{}; QueryPerformanceFrequency(&f); return f.QuadPart; }();
+	return ticks * 1'000'000 / frequency;
+}
+
+// Lock-free latency histogram. One writer, any number of readers, all relaxed atomics, so reading it never slows the writer down.
+// 10us buckets up to 20ms, plus one catch-all bucket for anything slower (which is already bad news).
+class LatencyHistogram {
+public:
+	static constexpr int64_t bucketUs = 10;
+	static constexpr size_t bucketCount = 2000;
+
+private:
+	std::array<std::atomic<uint32_t>, bucketCount + 1> buckets{};
+	std::atomic<uint64_t> count = 0;
+	std::atomic<int64_t> maxUs = 0;
+
+public:
+	void Record(int64_t us) {
+		us = std::max<int64_t>(us, 0);
+
+		buckets[std::min<size_t>(us / bucketUs, bucketCount)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+
+		// Only one writer, so a plain compare & store is enough.
+		if (us > maxUs.load(std::memory_order_relaxed))
+			maxUs.store(us, std::memory_order_relaxed);
+	}
+
+	uint64_t Count() const { return count.load(std::memory_order_relaxed); }
+	int64_t Max() const { return maxUs.load(std::memory_order_relaxed); }
+	uint32_t Bucket(size_t i) const { return buckets[i].load(std::memory_order_relaxed); }
+
+	// Upper edge of the bucket the p-th percentile (0-1) falls in. Good to 10us, which is plenty.
+	int64_t Percentile(double p) const {
+		uint64_t total = Count();
+		if (total == 0)
+			return 0;
+
+		uint64_t target = std::max<uint64_t>(1, (uint64_t)(p * total + 0.5));
+		uint64_t seen = 0;
+
+		for (size_t i = 0; i <= bucketCount; ++i) {
+			seen += Bucket(i);
+			if (seen >= target)
+				return i == bucketCount ? Max() : (int64_t)(i + 1) * bucketUs;
+		}
+
+		return Max();
+	}
+};
+
+// How long live input takes, split in two:
+// - driver: from the device timestamp (dwParam2) to our callback running. That's the driver & winmm's part.
+//   dwParam2 is whole milliseconds, so this one's only good to about a millisecond.
+// - emit: from our callback running to SendInput returning. That's ours (the queue & the emitter thread).
+struct LiveLatency {
+	LatencyHistogram driver;
+	LatencyHistogram emit;
+
+	// One line for the status label.
+	std::string Summary() const {
+		char buf[200];
+		snprintf(buf, sizeof(buf), "Live latency p50 %.2f / p99 %.2f / max %.2f ms (driver p50 %.2f ms, %llu notes)",
+			emit.Percentile(0.5) / 1000.0, emit.Percentile(0.99) / 1000.0, emit.Max() / 1000.0,
+			driver.Percentile(0.5) / 1000.0, (unsigned long long)emit.Count());
+		return buf;
+	}
+
+	// Both histograms, bucket by bucket, for a spreadsheet. Empty buckets are skipped.
+	bool WriteCsv(const std::string& path) const {
+		std::ofstream out(path);
+		if (!out)
+			return false;
+
+		out << "bucket_start_us,bucket_end_us,emit_count,driver_count\n";
+		for (size_t i = 0; i <= LatencyHistogram::bucketCount; ++i) {
+			uint32_t e = emit.Bucket(i);
+			uint32_t d = driver.Bucket(i);
+			if (e == 0 && d == 0)
+				continue;
+
+			int64_t from = (int64_t)i * LatencyHistogram::bucketUs;
+			out << from << ',';
+			if (i == LatencyHistogram::bucketCount)
+				out << "inf";
+			else
+				out << from + LatencyHistogram::bucketUs;
+			out << ',' << e << ',' << d << '\n';
+		}
+
+		out << "# emit p50_us=" << emit.Percentile(0.5) << " p99_us=" << emit.Percentile(0.99) << " max_us=" << emit.Max() << " count=" << emit.Count() << '\n';
+		out << "# driver p50_us=" << driver.Percentile(0.5) << " p99_us=" << driver.Percentile(0.99) << " max_us=" << driver.Max() << " count=" << driver.Count() << '\n';
+		return (bool)out;
+	}
+};
+
+// Registers the current thread with MMCSS as "Pro Audio" for as long as this lives, so the scheduler treats it like audio.
+// If MMCSS says no, we're just a normal thread, which still works.
+class ProAudioPriority {
+private:
+	HANDLE task{};
+	DWORD taskIndex = 0;
+
+public:
+	ProAudioPriority() {
+		task = AvSetMmThreadCharacteristicsW(L"Pro Audio", &taskIndex);
+	}
+
+	~ProAudioPriority() {
+		if (task)
+			AvRevertMmThreadCharacteristics(task);
+	}
+
+	ProAudioPriority(const ProAudioPriority&) = delete;
+	ProAudioPriority& operator=(const ProAudioPriority&) = delete;
+};
+
+// Multi producer, single consumer, lock-free bounded ring buffer (Vyukov style).
+// Any number of threads push, one thread pops. Each cell has a sequence number saying whose turn it is,
+// so producers only ever fight over the tail with a CAS, and never wait on each other or the consumer.
+// Capacity has to be a power of two, so wrapping is a mask instead of a divide.
+template <typename T, size_t Capacity>
+class MpscRing {
+	static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T item;
+	};
+
+	std::array<Cell, Capacity> cells;
+
+	// Own cache lines, so the producers & consumer don't keep stealing each other's.
+	alignas(64) std::atomic<size_t> tail = 0; // Next to push. Claimed by producers with a CAS.
+	alignas(64) size_t head = 0;              // Next to pop. Only the consumer touches it.
+
+public:
+	MpscRing() {
+		for (size_t i = 0; i < Capacity; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	// Producer side. False if it's full, in which case the item is dropped.
+	bool TryPush(const T& item) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+
+		for (;;) {
+			Cell& cell = cells[pos & (Capacity - 1)];
+			intptr_t diff = (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+
+			if (diff == 0) {
+				// Cell's free. Claim it, unless another producer beat us to it (then pos gets refreshed & we go again).
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.item = item;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; // Consumer hasn't freed it yet: full.
+			} else {
+				pos = tail.load(std::memory_order_relaxed); // Someone else took it. Try the new tail.
+			}
+		}
+	}
+
+	// Consumer side. False if there's nothing (finished) to pop.
+	bool TryPop(T& item) {
+		Cell& cell = cells[head & (Capacity - 1)];
+		if (cell.sequence.load(std::memory_order_acquire) != head + 1)
+			return false;
+
+		item = cell.item;
+		cell.sequence.store(head + Capacity, std::memory_order_release);
+		++head;
+		return true;
+	}
+};
+
+class MidiLiveInput {
+public:
+	// Where each played note goes, with the layout, transpose & compress all baked in, so handling a note is one array read.
+	// Built on the UI thread and handed over whole (see SetMapping). Only the worker ever reads one, so it's never locked.
+	struct Mapping {
+		std::array<uint16_t, 128> keys{}; // VK for each incoming note. 0 means nothing.
+		std::array<uint8_t, 128> notes{}; // The note that VK plays, for MIDI thru. Only meaningful where keys isn't 0.
+
+		Mapping(const KeyLayout& layout, int transpose, bool compress) {
+			const MidiMapper mapper(layout);
+
+			for (int played = 0; played < (int)keys.size(); ++played) {
+				int note = played + transpose;
+				if (compress)
+					note = Compress(note, mapper.Min(), mapper.Max());
+
+				keys[played] = (uint16_t)mapper.MapNote(note).value_or(0);
+				if (keys[played])
+					notes[played] = (uint8_t)note;
+			}
+		}
+	};
+
+private:
+	// A short MIDI message exactly as winmm hands it over. Decoding waits for the emitter thread.
+	struct RawMessage {
+		DWORD message;   // dwParam1: status, data1, data2 packed into the low 3 bytes. The top byte is free, so the device index goes there.
+		DWORD timestamp; // dwParam2: ms since midiInStart.
+		int64_t arrival; // QPC when the callback got it.
+	};
+
+	// One open input device. Heap allocated so its address (which winmm holds onto) never moves.
+	struct Device {
+		MidiLiveInput* owner;
+		uint8_t index;
+		HMIDIIN handle{};
+		std::string name;
+		std::atomic<int64_t> startQpc = 0; // When midiInStart was called. Its timestamps count from here.
+		std::bitset<128> held;             // Notes it's holding down. Worker thread only.
+		std::array<uint8_t, 128> channel{}; // Which channel each held note came in on, so the thru note off goes to the same one.
+	};
+
+	// Bounded by the top byte of RawMessage::message. 255 MIDI inputs is more than anyone has cables for.
+	static constexpr size_t maxDevices = 255;
+
+	std::vector<std::unique_ptr<Device>> devices;
+	KeyboardEmitter& emitter;
+
+	// The mapping in use (worker thread only), and the next one, if the UI's handed one over.
+	// The worker swaps it in between batches, and the old one gets deleted right there, since nothing else can be looking at it.
+	std::unique_ptr<const Mapping> mapping;
+	std::atomic<const Mapping*> pending = nullptr;
+
+	// Every device's callback pushes here & pokes the event. Everything else happens on the one worker.
+	MpscRing<RawMessage, 1024> queue;
+	HANDLE wake{}; // Auto-reset event. SetEvent is on the short list of things the callback is allowed to call.
+	std::jthread worker;
+
+	// How many held notes (across every device) are holding down each VK. Worker thread only, so no lock.
+	// Two devices on the same key means the key stays down until both let go.
+	std::array<uint16_t, 256> pressCount{};
+
+	// Written by the worker, readable from anywhere.
+	LiveLatency latency;
+
+	// MIDI thru, so you can hear what you're playing on a synth. Opened before the worker starts, closed after it's gone,
+	// so the worker's the only one sending on it and it's never locked.
+	HMIDIOUT thru{};
+	std::string thruName;
+
+	static void CALLBACK Callback(HMIDIIN, UINT msg, DWORD_PTR instance, DWORD_PTR param1, DWORD_PTR param2) {
+		// If it's not data, just return.
+		// MIM is midi callback messages, btw. Just in case you care. :pleading:
+		if (msg != MIM_DATA) return;
+
+		// Should I do reinterpret(static<void>(instance)) to get the linter to shut up? Do I care? Unsafe my ass.
+		auto* device = reinterpret_cast<Device*>(instance);
+		auto* self = device->owner;
+
+		// Hand it over and get out. If the queue's full the worker is hopelessly behind anyway, so dropping is fine.
+		DWORD message = ((DWORD)param1 & 0x00FFFFFF) | ((DWORD)device->index << 24);
+		if (self->queue.TryPush({message, (DWORD)param2, QpcNow()}))
+			SetEvent(self->wake);
+	}
+
+	// Echo a message to the thru device, if there is one. Straight from the worker, before the keys go out,
+	// since it's a quick call and the synth wants it just as soon as the game does.
+	void Thru(DWORD message) const {
+		if (thru)
+			midiOutShortMsg(thru, message & 0x00FFFFFF);
+	}
+
+	// Turn one message into a keystroke, if it's a note that maps to something and actually changes a key.
+	// True if it did. Thru gets the same notes the game does, with the same transpose & compress.
+	bool Handle(RawMessage raw, std::vector<KeyStroke>& out) {
+		Device& device = *devices[raw.message >> 24];
+
+		uint8_t status = raw.message & 0xFF;
+		uint8_t played = (raw.message >> 8) & 0x7F;
+		uint8_t vel = (raw.message >> 16) & 0xFF;
+
+		const bool noteOn = (status & 0xF0) == 0x90 && vel > 0;
+		const bool noteOff = ((status & 0xF0) == 0x80) || ((status & 0xF0) == 0x90 && vel == 0);
+
+		// Get the mapped key. Transpose & compress are already in the table.
+		const int mapped = mapping->keys[played];
+		const DWORD remapped = status | ((DWORD)mapping->notes[played] << 8) | ((DWORD)vel << 16);
+
+		// Not a note. Pedals, pitch bend & co. go to the synth as they are, but aftertouch is per note, so it needs moving too.
+		if (!noteOn && !noteOff) {
+			if ((status & 0xF0) != 0xA0)
+				Thru(raw.message);
+			else if (mapped != 0)
+				Thru(remapped);
+			return false;
+		}
+
+		// Nothing there.
+		if (mapped == 0)
+			return false;
+
+		uint16_t& count = pressCount[mapped & 0xFF];
+
+		if (noteOn) {
+			if (device.held[played]) // If this device is already holding it, return.
+				return false;
+
+			device.held[played] = true;
+			device.channel[played] = status & 0x0F;
+			Thru(remapped);
+
+			// Somebody else already has the key down. Just count it.
+			if (count++ > 0)
+				return false;
+
+			out.push_back(emitter.Resolve(mapped, true));
+			return true;
+
+		} else { // Note off.
+			if (!device.held[played]) // If this device isn't holding it, return.
+				return false;
+
+			device.held[played] = false;
+			Thru(0x80 | device.channel[played] | ((DWORD)mapping->notes[played] << 8));
+
+			// Only let go once the last note holding it does.
+			if (--count > 0)
+				return false;
+
+			out.push_back(emitter.Resolve(mapped, false));
+			return true;
+		}
+	}
+
+	// The emitter thread. Sleeps on the event, drains everything that's queued, sends it all in one go.
+	void Run(std::stop_token stop) {
+		// Keystrokes should beat pretty much everything else on the machine to the CPU.
+		ProAudioPriority priority;
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+		std::vector<KeyStroke> keys;
+		std::vector<int64_t> arrivals; // When each message that made a keystroke came in, for the latency numbers.
+		keys.reserve(64);
+		arrivals.reserve(64);
+
+		while (!stop.stop_requested()) {
+			WaitForSingleObject(wake, INFINITE);
+
+			// New mapping? Let go of everything first, since the keys held now are from the old one, and their note offs
+			// would look the wrong keys up in the new one. Notes still held just play again on their next press.
+			if (const Mapping* next = pending.exchange(nullptr, std::memory_order_acquire)) {
+				keys.clear();
+				ReleaseAll(keys);
+				if (!keys.empty())
+					emitter.SendKeys(keys);
+
+				mapping.reset(next);
+			}
+
+			// Whatever piled up while we were asleep (usually one message, sometimes a chord) goes out as one batch.
+			keys.clear();
+			arrivals.clear();
+			for (RawMessage raw; queue.TryPop(raw);) {
+				if (!Handle(raw, keys))
+					continue;
+
+				// Device timestamp vs when we actually heard about it. Both count from that device's midiInStart.
+				int64_t startQpc = devices[raw.message >> 24]->startQpc.load(std::memory_order_relaxed);
+				latency.driver.Record(QpcToUs(raw.arrival - startQpc) - (int64_t)raw.timestamp * 1000);
+				arrivals.push_back(raw.arrival);
+			}
+
+			if (keys.empty())
+				continue;
+
+			emitter.SendKeys(keys);
+
+			// And how long it took us, start to finish.
+			const int64_t sent = QpcNow();
+			for (int64_t arrival : arrivals)
+				latency.emit.Record(QpcToUs(sent - arrival));
+		}
+
+		// Let go of anything still held, so the game isn't left with a stuck key.
+		keys.clear();
+		ReleaseAll(keys);
+
+		if (!keys.empty())
+			emitter.SendKeys(keys);
+	}
+
+	// Key ups for everything held down, and forget every device's held notes. Worker thread only.
+	// The synth gets its note offs here too, looked up in the mapping they were pressed with.
+	void ReleaseAll(std::vector<KeyStroke>& out) {
+		for (int vKey = 0; vKey < (int)pressCount.size(); ++vKey) {
+			if (pressCount[vKey] > 0)
+				out.push_back(emitter.Resolve(vKey, false));
+		}
+		pressCount.fill(0);
+
+		for (auto& device : devices) {
+			for (int played = 0; thru && played < (int)device->held.size(); ++played) {
+				if (device->held[played])
+					Thru(0x80 | device->channel[played] | ((DWORD)mapping->notes[played] << 8));
+			}
+			device->held.reset();
+		}
+	}
+
+
+public:
+	MidiLiveInput(KeyboardEmitter& emitter, std::unique_ptr<const Mapping> mapping) : emitter(emitter), mapping(std::move(mapping)) {}
+
+	~MidiLiveInput() {
+		if (!devices.empty())
+			Stop(nullptr);
+		if (wake)
+			CloseHandle(wake);
+		delete pending.load();
+	}
+
+	// The callbacks hold pointers into us, so we can't move.
+	MidiLiveInput(const MidiLiveInput&) = delete;
+	MidiLiveInput& operator=(const MidiLiveInput&) = delete;
+
+	// What a MIDI output's called, for picking a thru device. IDs go from 0 to midiOutGetNumDevs() - 1.
+	static std::string OutputName(UINT id) {
+		MIDIOUTCAPSA caps{};
+		if (midiOutGetDevCapsA(id, &caps, sizeof(caps)) == MMSYSERR_NOERROR)
+			return caps.szPname;
+		return "MIDI out " + std::to_string(id + 1);
+	}
+
+	// thruDevice is a midiOut ID to echo everything to, or nothing for no thru.
+	void Start(HWND statusHwnd, std::optional<UINT> thruDevice = std::nullopt) {
+		// If there are no MIDI devices attached, we can't get midi input. Crazy. Crazy? I was-
+		UINT deviceCount = midiInGetNumDevs();
+		if (deviceCount == 0)
+			throw MidiDeviceException("No MIDI devices");
+
+		// Thru's a nice to have. If it won't open, play on without it and say so.
+		bool thruFailed = false;
+		if (thruDevice) {
+			thruName = OutputName(*thruDevice);
+
+			thruFailed = midiOutOpen(&thru, *thruDevice, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR;
+			if (thruFailed)
+				thru = {};
+		}
+
+		// The worker has to be up before the devices are, or the first notes just sit in the queue.
+		if (!wake)
+			wake = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+		worker = std::jthread([this](std::stop_token stop) { Run(stop); });
+
+		// Open everything that's plugged in. One failing (probably in use by something else) doesn't stop the rest.
+		// No data comes in until midiInStart, so the list is done growing before the worker ever reads it.
+		for (UINT id = 0; id < deviceCount && devices.size() < maxDevices; ++id) {
+			auto device = std::make_unique<Device>(this, (uint8_t)devices.size());
+
+			MIDIINCAPSA caps{};
+			if (midiInGetDevCapsA(id, &caps, sizeof(caps)) == MMSYSERR_NOERROR)
+				device->name = caps.szPname;
+
+			// Something up with this Midi device. I don't really care what. Not my problem.
+			if (midiInOpen(&device->handle, id, (DWORD_PTR)&Callback, (DWORD_PTR)device.get(), CALLBACK_FUNCTION) != MMSYSERR_NOERROR)
+				continue;
+
+			devices.push_back(std::move(device));
+		}
+
+		if (devices.empty()) {
+			StopWorker();
+			CloseThru();
+			throw MidiDeviceException("Failed to open MIDI device");
+		}
+
+		// GO GO GO
+		// Start listening to midi input.
+		for (auto& device : devices) {
+			device->startQpc = QpcNow();
+			midiInStart(device->handle);
+		}
+
+		std::string text = "Listening on " + std::to_string(devices.size()) + (devices.size() == 1 ? " MIDI device: " : " MIDI devices: ");
+		for (size_t i = 0; i < devices.size(); ++i)
+			text += (i ? ", " : "") + devices[i]->name;
+
+		if (thru)
+			text += ". Thru to " + thruName;
+		else if (thruFailed)
+			text += ". Couldn't open " + thruName + " for thru";
+
+		SetWindowTextA(statusHwnd, text.c_str());
+	}
+
+	void Stop(HWND statusHwnd) {
+		// Stop listening to midi input. No more callbacks after the close, so the queue only drains from here.
+		for (auto& device : devices) {
+			midiInStop(device->handle);
+			midiInClose(device->handle);
+		}
+
+		StopWorker();
+
+		// The worker's gone, so nothing can look at these anymore. It's let go of every thru note on the way out, too.
+		devices.clear();
+		CloseThru();
+
+		if (statusHwnd)
+			SetWindowTextA(statusHwnd, "Stopped.");
+	}
+
+	const LiveLatency& Latency() const {
+		return latency;
+	}
+
+	// Change transpose/compress/layout on the fly, without closing the devices. Any thread.
+	// If the worker hasn't picked up the last one yet, that one never got used, so it can just go.
+	void SetMapping(std::unique_ptr<const Mapping> next) {
+		delete pending.exchange(next.release(), std::memory_order_acq_rel);
+		if (wake)
+			SetEvent(wake);
+	}
+
+private:
+	void StopWorker() {
+		if (!worker.joinable())
+			return;
+
+		worker.request_stop();
+		SetEvent(wake); // It's probably asleep. Wake it up so it notices.
+		worker.join();
+	}
+
+	void CloseThru() {
+		if (thru)
+			midiOutClose(thru);
+		thru = {};
+	}
+};
+
+
+// Waits for playback deadlines. sleep_until on Windows usually wakes on the ~15.6ms system tick, which smears fast runs together.
+// Precise mode fixes that: a high resolution waitable timer (or timeBeginPeriod(1) on older Windows) gets us close,
+// then we spin the last stretch, on a thread MMCSS treats as "Pro Audio".
+// Construct it on the thread that's going to wait, since the thread priority stuff applies to the current thread.
+class PlaybackClock {
+public:
+	using Clock = std::chrono::steady_clock; // QPC on MSVC, so good enough to measure with.
+
+private:
+	// Sets the stop event when a stop gets requested, so a wait on it ends right then instead of at the deadline.
+	struct SignalStop {
+		HANDLE event;
+		void operator()() const { SetEvent(event); }
+	};
+
+	bool precise;
+	HANDLE timer{};
+	bool raisedPeriod = false;
+	std::optional<ProAudioPriority> priority;
+
+	std::stop_token stop;
+	HANDLE stopEvent{}; // Manual reset. Stays set once stopped.
+	std::optional<std::stop_callback<SignalStop>> onStop;
+
+	// How long before the deadline the OS wait should wake us, to spin the rest.
+	// The high resolution timer is good to ~0.5ms, timeBeginPeriod(1) sleeps can overshoot by a bit more.
+	std::chrono::microseconds SpinMargin() const {
+		return timer ? std::chrono::microseconds(1000) : std::chrono::microseconds(2000);
+	}
+
+	// Sleep on the stop event until `wake`, at whatever resolution the system timer's at.
+	void SleepUntil(Clock::time_point wake) const {
+		for (auto now = Clock::now(); now < wake && !stop.stop_requested(); now = Clock::now()) {
+			auto ms = std::chrono::ceil<std::chrono::milliseconds>(wake - now).count();
+			if (WaitForSingleObject(stopEvent, (DWORD)ms) == WAIT_OBJECT_0)
+				return;
+		}
+	}
+
+public:
+	PlaybackClock(bool precise, std::stop_token stop) : precise(precise), stop(stop) {
+		stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		onStop.emplace(stop, SignalStop{stopEvent}); // Runs right away if we've already been stopped.
+
+		if (!precise)
+			return;
+
+		timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+		// No high resolution timer? Crank the system timer instead. Costs a bit of battery, sure.
+		if (!timer)
+			raisedPeriod = timeBeginPeriod(1) == MMSYSERR_NOERROR;
+
+		// Ask MMCSS to schedule us like audio.
+		priority.emplace();
+	}
+
+	~PlaybackClock() {
+		// Unregister first, so a stop can't go poking the event after it's closed.
+		onStop.reset();
+		CloseHandle(stopEvent);
+
+		if (raisedPeriod)
+			timeEndPeriod(1);
+		if (timer)
+			CloseHandle(timer);
+	}
+
+	// Owns a timer handle & the thread's MMCSS registration. Not copying that.
+	PlaybackClock(const PlaybackClock&) = delete;
+	PlaybackClock& operator=(const PlaybackClock&) = delete;
+
+	bool IsPrecise() const { return precise; }
+
+	// Wait until the deadline. Returns how late we actually woke up, so callers can tell how well it's going.
+	// Returns early if a stop gets requested, so check for that after.
+	std::chrono::microseconds WaitUntil(Clock::time_point deadline) const {
+		if (!precise) {
+			SleepUntil(deadline);
+		} else {
+			// Sleep most of the way with the OS...
+			if (auto wake = deadline - SpinMargin(); wake > Clock::now()) {
+				if (timer) {
+					// Relative due time, in 100ns units. Negative means relative. Yes, really.
+					LARGE_INTEGER due{};
+					due.QuadPart = -(LONGLONG)(std::chrono::duration_cast<std::chrono::nanoseconds>(wake - Clock::now()).count() / 100);
+
+					// Whichever comes first: the timer, or a stop.
+					const HANDLE handles[] = {timer, stopEvent};
+					if (due.QuadPart < 0 && SetWaitableTimer(timer, &due, 0, nullptr, nullptr, FALSE))
+						WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+				} else {
+					SleepUntil(wake);
+				}
+			}
+
+			// ...then spin the rest.
+			while (Clock::now() < deadline && !stop.stop_requested())
+				YieldProcessor();
+		}
+
+		return std::max(std::chrono::microseconds(0), std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - deadline));
+	}
+};
+
+
+// What playback waits on before it starts: either the game window coming to the front, or a countdown.
+// Stop gets through either way, instead of sitting out a Sleep.
+class StartTrigger {
+private:
+	std::mutex mutex;
+	std::condition_variable_any fired;
+	bool ready = false;
+
+public:
+	// Call before each play, so an old trigger doesn't start the new one.
+	void Reset() {
+		std::scoped_lock lock(mutex);
+		ready = false;
+	}
+
+	// The game's up front. Fine to call before anyone's waiting, it'll still count.
+	void Fire() {
+		{
+			std::scoped_lock lock(mutex);
+			ready = true;
+		}
+
+		fired.notify_all();
+	}
+
+	// Waits for Fire, or for `timeout` if there is one (that counts as starting too).
+	// False if a stop got requested first.
+	bool Wait(std::stop_token stop, std::optional<std::chrono::milliseconds> timeout) {
+		std::unique_lock lock(mutex);
+
+		if (timeout.has_value())
+			fired.wait_for(lock, stop, *timeout, [&] { return ready; });
+		else
+			fired.wait(lock, stop, [&] { return ready; });
+
+		return !stop.stop_requested();
+	}
+};
+
+
+// Everything that decides what keys a song compiles to. Read off the UI in one go, so a background thread
+// can work with it without touching any controls.
+struct CompileSettings {
+	const KeyLayout* layout = &fullLayout; // Notes to keys. Points into the LayoutLibrary.
+	bool compress = false;
+	int transpose = 0;
+	ThinSettings thin;
+	NoteFilter filter;
+	HKL keyboardLayout{};
+};
+
+// Everything a compiled schedule depends on, for looking it up in the cache.
+SongCacheKey MakeCacheKey(const CompileSettings& settings, const MappedFile& file) {
+	// Layouts get hashed by what's in them rather than which one it is, so editing layouts.ini doesn't serve up stale songs.
+	const auto& keys = settings.layout->keys;
+	const uint64_t noteLayout = HashBytes({reinterpret_cast<const uint8_t*>(keys.data()), sizeof(keys)});
+
+	return {HashBytes(file.Bytes()), (uint64_t)(uintptr_t)settings.keyboardLayout, noteLayout, settings.transpose, settings.compress, settings.thin,
+		settings.filter.Hash()};
+}
+
+// Parse, compile & thin a whole song in one go.
+std::vector<ScheduledKey> CompileSong(std::span<const uint8_t> data, const ScheduleCompiler& compiler, const CompileSettings& settings, std::string& thinSummary) {
+	ScheduleCompiler::HeldKeys held;
+	auto keys = compiler.Compile(MidiFileParser::Parse(data, settings.filter), &held);
+
+	ScheduleThinner thinner(settings.thin);
+	thinner.Thin(keys);
+	thinner.AddCollapsed(held);
+
+	if (settings.thin.enabled)
+		thinSummary = thinner.Summary();
+
+	return keys;
+}
+
+// "1234 keys, 3:21", for the status.
+std::string DescribeSong(uint64_t keys, uint32_t durationMs) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%llu keys, %u:%02u", (unsigned long long)keys, durationMs / 60000, durationMs / 1000 % 60);
+	return buf;
+}
+
+// Every track, one per line: "Track 2 "Piano": 1234 notes on channel 1". For picking what to play.
+// Black MIDIs can have thousands, so it stops after maxLines (but always says how many it didn't show).
+std::string DescribeTracks(std::span<const uint8_t> data, size_t maxLines = SIZE_MAX) {
+	const auto tracks = MidiFileParser::Scan(data);
+
+	std::string text;
+	for (size_t i = 0; i < tracks.size() && i < maxLines; ++i) {
+		const auto& track = tracks[i];
+
+		text += "Track " + std::to_string(i + 1);
+		if (!track.name.empty())
+			text += " \"" + track.name + "\"";
+		text += ": " + std::to_string(track.notes) + " notes";
+
+		for (int ch = 0, listed = 0; ch < 16; ++ch) {
+			if ((track.channels >> ch) & 1)
+				text += (listed++ ? ", " : std::popcount(track.channels) == 1 ? " on channel " : " on channels ") + std::to_string(ch + 1);
+		}
+		text += "\n";
+	}
+
+	if (tracks.size() > maxLines)
+		text += "...and " + std::to_string(tracks.size() - maxLines) + " more.\n";
+
+	return text;
+}
+
+// Files at least this big get streamed rather than parsed up front. Below it, parsing is quick enough not to notice.
+constexpr size_t streamingThreshold = 4 * 1024 * 1024;
+
+// Gets a song ready in the background as soon as it's picked, so by the time Play's hit it's already in the cache.
+// One worker, latest request wins: picking five files in a row doesn't queue up five parses.
+class Preparser {
+public:
+	using Report = std::function<void(std::string)>; // Status text. Called on the worker.
+
+private:
+	struct Job {
+		std::string path;
+		CompileSettings settings;
+		bool diskCache;
+	};
+
+	SongCache& cache;
+	Report report;
+
+	std::mutex mutex;
+	std::condition_variable_any changed;
+	std::optional<Job> next;
+	std::optional<SongCacheKey> working; // What's being compiled right now, if anything.
+	std::jthread worker; // Last, so it's stopped before the rest goes away.
+
+	void Prepare(const Job& job) {
+		std::optional<MappedFile> file;
+		try {
+			file.emplace(job.path);
+		} catch (const std::exception&) {
+			return; // Probably still being typed. Not worth a status.
+		}
+
+		if (SongPack::IsPack(file->Bytes())) {
+			SongPack pack(file->Bytes());
+			report("Song pack ready: " + DescribeSong(pack.Count(), pack.DurationMs()) + ".");
+			return;
+		}
+
+		// Play streams these, so parsing it all up front here would only bring back the wait (and the memory) streaming gets rid of.
+		if (file->Bytes().size() >= streamingThreshold) {
+			report("Big file, it'll stream while it plays.");
+			return;
+		}
+
+		const SongCacheKey key = MakeCacheKey(job.settings, *file);
+		const std::string diskPath = SongCache::DiskPath(job.path);
+
+		SongCache::Schedule schedule = cache.Find(key);
+		if (!schedule && job.diskCache) {
+			schedule = SongCache::Load(diskPath, key);
+			if (schedule)
+				cache.Insert(key, schedule);
+		}
+
+		if (!schedule) {
+			{
+				std::scoped_lock lock(mutex);
+				working = key;
+			}
+
+			// Let anyone waiting on this know when it's done, however it ends.
+			struct Done {
+				Preparser& self;
+				~Done() {
+					{
+						std::scoped_lock lock(self.mutex);
+						self.working.reset();
+					}
+					self.changed.notify_all();
+				}
+			} done{*this};
+
+			MidiMapper mapper(*job.settings.layout);
+			KeyboardEmitter emitter(job.settings.keyboardLayout);
+			const ScheduleCompiler compiler(mapper, emitter, job.settings.transpose, job.settings.compress, job.settings.thin.enabled);
+
+			std::string thinSummary;
+			schedule = std::make_shared<const std::vector<ScheduledKey>>(CompileSong(file->Bytes(), compiler, job.settings, thinSummary));
+			cache.Insert(key, schedule);
+
+			if (job.diskCache)
+				SongCache::Save(diskPath, key, *schedule);
+		}
+
+		report("Ready: " + DescribeSong(schedule->size(), schedule->empty() ? 0 : schedule->back().timeMs) + ".");
+	}
+
+	void Run(std::stop_token stop) {
+		while (true) {
+			Job job;
+			{
+				std::unique_lock lock(mutex);
+				changed.wait(lock, stop, [&] { return next.has_value(); });
+				if (stop.stop_requested())
+					return;
+
+				job = std::move(*next);
+				next.reset();
+			}
+
+			try {
+				Prepare(job);
+			} catch (const std::exception& ex) {
+				report(ex.what()); // Bad file. Might as well say so now.
+			}
+		}
+	}
+
+public:
+	Preparser(SongCache& cache, Report report) : cache(cache), report(std::move(report)) {
+		worker = std::jthread([this](std::stop_token stop) { Run(stop); });
+	}
+
+	// Replaces whatever was waiting (but not what's already being worked on).
+	void Request(std::string path, const CompileSettings& settings, bool diskCache) {
+		{
+			std::scoped_lock lock(mutex);
+			next = Job{std::move(path), settings, diskCache};
+		}
+		changed.notify_all();
+	}
+
+	// If that exact song's being compiled right now, wait for it to land in the cache.
+	void WaitFor(const SongCacheKey& key, std::stop_token stop) {
+		std::unique_lock lock(mutex);
+		changed.wait(lock, stop, [&] { return working != key; });
+	}
+};
+
+
+// Streamed songs with more keys than this don't get cached. 8 bytes a key, so this is 64MB.
+constexpr size_t maxRecordedKeys = 8 * 1024 * 1024;
+
+// Running total of how late each chord went out, as measured by PlaybackClock.
+struct LatenessStats {
+	uint64_t count = 0;
+	uint64_t totalUs = 0;
+	uint64_t maxUs = 0;
+
+	void Add(std::chrono::microseconds late) {
+		++count;
+		totalUs += late.count();
+		maxUs = std::max<uint64_t>(maxUs, late.count());
+	}
+
+	std::string Summary(bool precise) const {
+		char buf[160];
+		snprintf(buf, sizeof(buf), "Done. Lateness avg %.2f ms, max %.2f ms (%s timing)",
+			count ? totalUs / 1000.0 / count : 0.0, maxUs / 1000.0, precise ? "precise" : "standard");
+		return buf;
+	}
+};
+
+// Every chord's timing, so when a song sounds off it's possible to tell whether we (well, the OS waking us) were late, or the game was.
+// Room for all of it is made before playing, so recording is a couple of stores. Anything past that just gets counted.
+class TimingReport {
+public:
+	struct Sample {
+		uint32_t songMs; // When it was meant to go out, in song time.
+		int32_t wakeUs;  // How late we woke up for it.
+		int32_t sentUs;  // How late it was once SendInput returned. Minus wakeUs, that's SendInput's part.
+		uint32_t keys;
+	};
+	static_assert(sizeof(Sample) == 16);
+
+	// 2M chords, 32MB. Way past any sane song.
+	static constexpr size_t maxSamples = 2 * 1024 * 1024;
+
+	struct Stats {
+		size_t count = 0;
+		double meanUs = 0;
+		int64_t p99Us = 0;
+		int64_t maxUs = 0;
+		double driftUsPerMinute = 0; // How much later things got as the song went on. Positive means falling behind.
+	};
+
+private:
+	std::vector<Sample> samples;
+	uint64_t dropped = 0;
+
+public:
+	explicit TimingReport(size_t expected) {
+		samples.reserve(std::clamp<size_t>(expected, 1024, maxSamples));
+	}
+
+	void Record(uint32_t songMs, std::chrono::microseconds wake, std::chrono::microseconds sent, size_t keys) {
+		if (samples.size() == samples.capacity()) {
+			++dropped;
+			return;
+		}
+
+		samples.push_back({songMs, (int32_t)std::min<int64_t>(wake.count(), INT32_MAX),
+			(int32_t)std::min<int64_t>(sent.count(), INT32_MAX), (uint32_t)keys});
+	}
+
+	// After playing. Sorts a copy for the percentile, so don't call it mid-song.
+	Stats Compute() const {
+		Stats stats;
+		stats.count = samples.size();
+		if (samples.empty())
+			return stats;
+
+		std::vector<int32_t> sorted(samples.size());
+		double sum = 0;
+		for (size_t i = 0; i < samples.size(); ++i) {
+			sorted[i] = samples[i].sentUs;
+			sum += samples[i].sentUs;
+		}
+
+		stats.meanUs = sum / samples.size();
+		const size_t p99 = std::min(sorted.size() - 1, (size_t)(sorted.size() * 0.99));
+		std::ranges::nth_element(sorted, sorted.begin() + p99);
+		stats.p99Us = sorted[p99];
+		stats.maxUs = *std::ranges::max_element(sorted);
+
+		// Least squares line through lateness against song time. The slope is the drift.
+		double meanX = 0;
+		for (const Sample& sample : samples)
+			meanX += sample.songMs;
+		meanX /= samples.size();
+
+		double covariance = 0;
+		double variance = 0;
+		for (const Sample& sample : samples) {
+			covariance += (sample.songMs - meanX) * (sample.sentUs - stats.meanUs);
+			variance += (sample.songMs - meanX) * (sample.songMs - meanX);
+		}
+
+		if (variance > 0)
+			stats.driftUsPerMinute = covariance / variance * 60000;
+
+		return stats;
+	}
+
+	std::string Summary() const {
+		const Stats stats = Compute();
+		char buf[120];
+		snprintf(buf, sizeof(buf), "p99 %.2f ms, drift %+.2f ms/min", stats.p99Us / 1000.0, stats.driftUsPerMinute / 1000.0);
+		return buf;
+	}
+
+	// Every chord, one per line, for a spreadsheet. Totals at the bottom, like the live latency log.
+	bool WriteCsv(const std::string& path) const {
+		std::ofstream out(path);
+		if (!out)
+			return false;
+
+		out << "song_ms,wake_late_us,sent_late_us,keys\n";
+		for (const Sample& sample : samples)
+			out << sample.songMs << ',' << sample.wakeUs << ',' << sample.sentUs << ',' << sample.keys << '\n';
+
+		const Stats stats = Compute();
+		out << "# sent mean_us=" << stats.meanUs << " p99_us=" << stats.p99Us << " max_us=" << stats.maxUs
+			<< " drift_us_per_min=" << stats.driftUsPerMinute << " count=" << stats.count << " dropped=" << dropped << '\n';
+		return (bool)out;
+	}
+};
+
+// Pause & seek. Whoever's in charge asks, the playback thread does it between chords.
+struct Transport {
+	std::mutex mutex;
+	std::condition_variable_any changed; // Unpausing. Stopping gets through via the stop token.
+	std::atomic<bool> paused = false;
+	std::atomic<int64_t> seekMs = -1; // -1 for nothing asked.
+	std::atomic<uint32_t> positionMs = 0;
+	std::atomic<uint32_t> durationMs = 0;
+	std::atomic<bool> seekable = false; // Only once the whole song's in memory.
+	std::atomic<uint64_t> keysSent = 0; // Running total, for a keys/s readout. Relaxed, it's only ever looked at.
+
+	void Reset() {
+		paused = false;
+		seekMs = -1;
+		positionMs = 0;
+		durationMs = 0;
+		seekable = false;
+		keysSent = 0;
+	}
+};
+
+// One play of one song. Fixed once it starts.
+struct PlayJob {
+	std::string path;
+	CompileSettings compile;
+	bool precise = true;
+	bool diskCache = false;
+	std::optional<std::chrono::milliseconds> countdown = std::chrono::milliseconds(3000); // Nothing means wait for the trigger.
+	std::string timingPath; // Where to save the timing report. Empty for no report.
+};
+
+// What playback works with, that outlives a single play. No UI in here, so the window and the command line can both drive it.
+struct PlayContext {
+	SongCache& cache;
+	Preparser* preparser; // Optional.
+	StartTrigger& trigger;
+	Transport& transport;
+	const std::atomic<bool>& loop; // Can be flipped mid-song.
+	std::function<void(const std::string&)> status; // Called on the playing thread.
+};
+
+// Play a song start to finish (or until stopped), on the calling thread. Returns the summary for the status.
+// Parsing is probably one of the most likely parts to throw an error, and that comes straight out of here.
+std::string PlaySong(std::stop_token stop, const PlayJob& job, const KeyboardEmitter& emitter, PlayContext& ctx) {
+	const CompileSettings& settings = job.compile;
+	Transport& transport = ctx.transport;
+
+	// Set up the map, and open the midi file.
+	MidiMapper mapper(*settings.layout);
+	MappedFile file(job.path);
+
+	// Resolve every note to its keystroke ahead of time, so the loop below only has to sleep & send.
+	// Notes overlapping on a key get collapsed when thinning, and retriggered otherwise.
+	const ScheduleCompiler compiler(mapper, emitter, settings.transpose, settings.compress, settings.thin.enabled);
+
+	// Already a song pack? Then it's already compiled too, and plays straight out of the file.
+	std::optional<SongPack> pack;
+	if (SongPack::IsPack(file.Bytes()))
+		pack.emplace(file.Bytes());
+
+	// Played this exact song with these exact settings before? Then it's already compiled.
+	SongCacheKey cacheKey{};
+	SongCache::Schedule schedule;
+	const std::string diskCachePath = SongCache::DiskPath(job.path);
+
+	if (!pack) {
+		cacheKey = MakeCacheKey(settings, file);
+
+		// Picked the file a moment ago, and it's still being got ready in the background? Wait for that instead of doing it twice.
+		if (ctx.preparser)
+			ctx.preparser->WaitFor(cacheKey, stop);
+		schedule = ctx.cache.Find(cacheKey);
+	}
+
+	if (!pack && !schedule && job.diskCache) {
+		schedule = SongCache::Load(diskCachePath, cacheKey);
+		if (schedule)
+			ctx.cache.Insert(cacheKey, schedule);
+	}
+
+	// Big files get streamed instead: parsing carries on in the background while we play, so there's no wait up front.
+	// Small ones are quicker to just do in one go, and then looping doesn't have to parse again.
+	const bool streaming = !pack && !schedule && file.Bytes().size() >= streamingThreshold;
+
+	std::optional<ScheduleStream> stream;
+
+	// Keys that came out of the stream, kept so the song can go in the cache once it's played through.
+	// Given up on past a point, so streaming something huge doesn't quietly eat all the memory anyway.
+	std::vector<ScheduledKey> streamed;
+	bool recording = streaming;
+
+	auto remember = [&](std::vector<ScheduledKey> keys) {
+		schedule = std::make_shared<const std::vector<ScheduledKey>>(std::move(keys));
+		ctx.cache.Insert(cacheKey, schedule);
+
+		if (job.diskCache)
+			SongCache::Save(diskCachePath, cacheKey, *schedule);
+	};
+
+	// What thinning took out, for the status at the end. Only known when we actually compiled it this time.
+	std::string thinSummary;
+
+	if (streaming)
+		stream.emplace(file.Bytes(), compiler, settings.thin, settings.filter); // Starts producing now, so the queue's full by the end of the countdown.
+	else if (!pack && !schedule)
+		remember(CompileSong(file.Bytes(), compiler, settings, thinSummary));
+
+	// How late every chord went out. Shown when we're done.
+	LatenessStats lateness;
+
+	// And, if asked, every chord's timing on its own. Streams don't know how long they are yet, so guess from the size.
+	std::optional<TimingReport> timing;
+	if (!job.timingPath.empty())
+		timing.emplace(schedule ? schedule->size() : pack ? pack->Count() : file.Bytes().size() / 4);
+
+	// Reused for every chord, so it stops allocating after the first big one.
+	std::vector<KeyStroke> chord;
+	chord.reserve(16);
+
+	// Same deal, for the keys decoded out of a song pack.
+	std::vector<ScheduledKey> packChunk;
+
+	// Set up the clock on this thread, since it bumps this thread's priority.
+	const PlaybackClock clock(job.precise, stop);
+
+	// What we've actually got pressed right now, so pausing & stopping can let go of it all.
+	KeyboardState held;
+
+	// Send a bunch of keystrokes that aren't on the schedule. Reuses the chord buffer, since we're between chords anyway.
+	auto sendAll = [&](auto fill) {
+		chord.clear();
+		fill(chord);
+		emitter.SendKeys(chord);
+	};
+
+	// Deal with a pause or a seek, from just before key `i`. False if we got stopped while paused.
+	// Seeking only works with an index (i.e. the whole song's in memory), otherwise it's ignored.
+	auto handleTransport = [&](size_t& i, PlaybackClock::Clock::time_point& start, const ScheduleIndex* index) {
+		// Where we are in the song. Resuming carries on from here, so pausing mid-rest doesn't skip the rest of it.
+		auto elapsed = std::max(std::chrono::milliseconds(0), std::chrono::duration_cast<std::chrono::milliseconds>(PlaybackClock::Clock::now() - start));
+		bool released = false;
+
+		if (transport.paused) {
+			// Let go of everything, so nothing's stuck down in the game while we wait.
+			sendAll([&](auto& out) { held.Releases(out); });
+			released = true;
+
+			std::unique_lock lock(transport.mutex);
+			transport.changed.wait(lock, stop, [&] { return !transport.paused; });
+			if (stop.stop_requested())
+				return false;
+		}
+
+		if (int64_t seek = transport.seekMs.exchange(-1); seek >= 0 && index) {
+			if (!released)
+				sendAll([&](auto& out) { held.Releases(out); });
+			released = true;
+
+			i = index->Find((uint32_t)seek);
+			held = index->HeldAt(i);
+			elapsed = std::chrono::milliseconds(seek);
+		}
+
+		// Put back whatever should be held here, then pick the clock up where we left off.
+		if (released)
+			sendAll([&](auto& out) { held.Presses(out); });
+
+		start = PlaybackClock::Clock::now() - elapsed;
+		transport.positionMs = (uint32_t)elapsed.count();
+		return true;
+	};
+
+	// Play a run of keys, starting the clock at `start`. False if we got stopped partway.
+	auto playKeys = [&](std::span<const ScheduledKey> keys, PlaybackClock::Clock::time_point& start, const ScheduleIndex* index = nullptr) {
+		// Iterate through and play each keystroke. Everything on the same millisecond goes out as one chord.
+		for (size_t i = 0; i < keys.size();) {
+			// Stop early if requested
+			if (stop.stop_requested()) return false;
+
+			if (transport.paused || transport.seekMs >= 0) {
+				if (!handleTransport(i, start, index)) return false;
+				continue;
+			}
+
+			const uint32_t timeMs = keys[i].timeMs;
+
+			// Sleep intil the event, and keep track of how late we were.
+			// Stop wakes this up straight away, even in the middle of a long rest.
+			const auto deadline = start + std::chrono::milliseconds(timeMs);
+			auto late = clock.WaitUntil(deadline);
+			if (stop.stop_requested()) return false;
+			lateness.Add(late);
+
+			chord.clear();
+			for (; i < keys.size() && keys[i].timeMs == timeMs; ++i) {
+				chord.push_back(keys[i].key);
+				held.Apply(keys[i].key);
+			}
+
+			emitter.SendKeys(chord);
+			transport.positionMs = timeMs;
+			transport.keysSent.fetch_add(chord.size(), std::memory_order_relaxed);
+
+			if (timing)
+				timing->Record(timeMs, late, std::chrono::duration_cast<std::chrono::microseconds>(PlaybackClock::Clock::now() - deadline), chord.size());
+		}
+
+		return true;
+	};
+
+	// Seeking needs the whole song, so only compiled ones get an index. Built the first time it's played.
+	std::optional<ScheduleIndex> index;
+
+	// Wait for the trigger (the game coming to the front), or the countdown. Stop cuts either one short, and then nothing below plays.
+	const bool started = ctx.trigger.Wait(stop, job.countdown);
+
+	// Set text anticipatorily. That's not a word, I'm pretty sure. In anticipation.
+	if (started)
+		ctx.status("Playing...");
+
+	// A bad file (a truncated MIDI, a corrupt pack) can throw out of the middle of this. Let go of everything on the way out
+	// then too, or the game's left with every held key stuck down.
+	try {
+		// How often do you get to use a do while loop in programming? I find them pretty rare, all things considered...
+		do {
+			// Set the start before we play the song.
+			// I forgot to move this into the do-while before and spent far too long figuring out the issue.
+			auto start = PlaybackClock::Clock::now();
+
+			// Already compiled (cached, or a small file, or a streamed one we've now played through once).
+			if (schedule) {
+				if (!index) {
+					index.emplace(*schedule);
+					transport.durationMs = index->DurationMs();
+					transport.seekable = true;
+				}
+
+				playKeys(*schedule, start, &*index);
+				continue;
+			}
+
+			if (pack) {
+				transport.durationMs = pack->DurationMs();
+				SongPack::Reader reader(*pack);
+				while (reader.Next(packChunk) && playKeys(packChunk, start));
+				continue;
+			}
+
+			// Looping a streamed file streams it again. The file's mapped, so that's cheap.
+			if (!stream)
+				stream.emplace(file.Bytes(), compiler, settings.thin, settings.filter);
+
+			bool finished = true;
+			while (auto chunk = stream->Next()) {
+				if (recording) {
+					recording = streamed.size() + chunk->size() <= maxRecordedKeys;
+					if (recording)
+						streamed.insert(streamed.end(), chunk->begin(), chunk->end());
+					else
+						streamed = {};
+				}
+
+				if (!playKeys(*chunk, start)) {
+					finished = false;
+					break;
+				}
+			}
+
+			if (finished && settings.thin.enabled)
+				thinSummary = stream->Thinner().Summary();
+
+			stream.reset();
+
+			// Made it all the way through without getting too big? Cache it, and loop from memory from now on.
+			if (finished && recording)
+				remember(std::move(streamed));
+			recording = false;
+		} while (ctx.loop && !stop.stop_requested());
+	} catch (...) {
+		sendAll([&](auto& out) { held.Releases(out); });
+		throw;
+	}
+
+	// Stopped partway (or the song left something hanging)? Don't leave keys stuck down in the game.
+	sendAll([&](auto& out) { held.Releases(out); });
+
+	std::string summary = lateness.Summary(clock.IsPrecise());
+	if (timing)
+		summary += ", " + timing->Summary() + (timing->WriteCsv(job.timingPath) ? ", timing saved to " + job.timingPath : ", couldn't write timing log");
+	if (!thinSummary.empty())
+		summary += ", " + thinSummary;
+
+	return summary;
+}
+
+
+// Control IDs. have to be ints rather than HMENU to appease the linter's pointer const requirements.
+constexpr int ID_EDIT_FILE = 101;
+constexpr int ID_BTN_BROWSE = 102;
+constexpr int ID_CMB_LAYOUT = 103;
 constexpr int ID_CHK_LOOP = 104;
 constexpr int ID_CHK_COMPRESS = 105;
 constexpr int ID_EDIT_TRANSPOSE = 106;
@@ -508,30 +3446,92 @@ constexpr int ID_BTN_PLAY = 108;
 constexpr int ID_BTN_LIVE = 109;
 constexpr int ID_BTN_STOP = 110;
 constexpr int ID_LBL_STATUS = 111;
+constexpr int ID_CHK_PRECISE = 112;
+constexpr int ID_CHK_LATENCY_LOG = 113;
+constexpr int ID_CHK_DISK_CACHE = 114;
+constexpr int ID_BTN_EXPORT = 115;
+constexpr int ID_CHK_THIN = 116;
+constexpr int ID_EDIT_MAX_KEYS = 117;
+constexpr int ID_EDIT_MIN_GAP = 118;
+constexpr int ID_BTN_PAUSE = 119;
+constexpr int ID_TRK_SEEK = 120;
+constexpr int ID_LBL_POSITION = 121;
+constexpr int ID_CHK_FOCUS_START = 122;
+constexpr int ID_CMB_THRU = 123;
+constexpr int ID_EDIT_CHANNELS = 124;
+constexpr int ID_EDIT_TRACKS = 125;
+constexpr int ID_BTN_TRACKS = 126;
+
+// Timer IDs
+constexpr int ID_TMR_LATENCY = 201;
+constexpr int ID_TMR_PROGRESS = 202;
+constexpr int ID_TMR_PREPARSE = 203;
+
+// Messages from the playback thread. The wParam is its session, the lParam a new'd std::string of status text (the UI frees it).
+constexpr UINT WM_APP_STATUS = WM_APP + 1;
+constexpr UINT WM_APP_PLAY_DONE = WM_APP + 2;
+constexpr UINT WM_APP_PREPARSED = WM_APP + 3; // From the preparser. Only shown if nothing's playing.
 
 struct AppState {
 	std::string filePath;
-	bool whitesOnly = false;
-	bool loop = false;
+	LayoutLibrary layouts; // Loaded before the window's made, and the same from then on.
+	size_t layoutIndex = 0;
+	std::atomic<bool> loop = false; // Can be flipped mid-song.
 	bool compress = false;
+	bool precise = true;
+	bool latencyLog = false;
+	bool diskCache = false;
+	bool focusStart = false;
 	int transpose = 0;
+	bool thin = false;
+	std::optional<UINT> thruDevice; // MIDI out to echo live input to. Nothing's no thru.
 	std::atomic<bool> playing = false;
+	uint32_t playSession = 0; // Which playback the UI's showing. UI thread only.
 	std::atomic<bool> liveMode = false;
+	std::atomic<HKL> keyboardLayout{}; // The UI thread's keyboard layout. Emitters map scancodes with it.
+
+	// Pause & seek. The UI asks, the playback thread does it.
+	Transport transport;
+
+	// Starting on the game window coming to the front, instead of after a countdown.
+	StartTrigger startTrigger;
+	HWINEVENTHOOK focusHook{}; // UI thread only. Hooks have to be removed from the thread that set them.
 
 	// Handles
 	HWND handleEdit{};
-	HWND handleChkWhites{};
+	HWND handleCmbLayout{};
 	HWND handleChkLoop{};
 	HWND handleChkCompress{};
+	HWND handleChkPrecise{};
+	HWND handleChkLatencyLog{};
+	HWND handleChkDiskCache{};
+	HWND handleBtnExport{};
+	HWND handleChkThin{};
+	HWND handleEditMaxKeys{};
+	HWND handleEditMinGap{};
+	HWND handleBtnPause{};
+	HWND handleTrackSeek{};
+	HWND handlePosition{};
+	HWND handleChkFocusStart{};
+	HWND handleCmbThru{};
+	HWND handleEditChannels{};
+	HWND handleEditTracks{};
 	HWND handleEditTranspose{};
 	HWND handleSpinTranspose{};
 	HWND handleBtnPlay{};
 	HWND handleBtnLive{};
 	HWND handleBtnStop{};
 	HWND handleStatus{};
+	HWND handleWindow{};
+
+	// Compiled songs, for replaying without parsing.
+	SongCache songCache;
+	std::unique_ptr<Preparser> preparser; // Fills the cache as soon as a file's picked.
+	// keys/s on the position label: the transport's total the last time it was looked at, and when. UI thread only.
+	uint64_t rateKeys = 0;
+	std::chrono::steady_clock::time_point rateTime;
 
 	// Live input session stuff
-	std::unique_ptr<MidiMapper> liveMapper;
 	std::unique_ptr<KeyboardEmitter> liveEmitter;
 	std::unique_ptr<MidiLiveInput> liveInput;
 };
@@ -541,93 +3541,169 @@ AppState* g_state = nullptr;
 std::jthread playThread;
 
 
-void Play(AppState& state) {
-	// Put the playing and parsing inside a try/catch for "good enough" error handling
-	try {
-		// Update value
-		state.whitesOnly = (IsDlgButtonChecked(GetParent(state.handleChkWhites), ID_CHK_WHITES) == BST_CHECKED);
-		state.compress = (IsDlgButtonChecked(GetParent(state.handleChkCompress), ID_CHK_COMPRESS) == BST_CHECKED);
+// Hand some status text to the UI thread, without waiting on it.
+void PostStatus(const AppState& state, UINT msg, uint32_t session, std::string text) {
+	auto* heap = new std::string(std::move(text));
+	if (!PostMessageW(state.handleWindow, msg, session, (LPARAM)heap))
+		delete heap;
+}
 
-		// Get the transposition
-		std::string buf(256, '\0');
-		GetWindowTextA(state.handleEditTranspose, buf.data(), buf.size());
-		state.transpose = 12 * stoi(buf);
+// Read the settings that go into compiling a song off the UI. UI thread only. Throws if the transpose, channel or track boxes are junk.
+CompileSettings ReadCompileSettings(const AppState& state) {
+	CompileSettings settings;
+	settings.layout = &state.layouts[state.layoutIndex].layout;
+	settings.compress = (IsDlgButtonChecked(GetParent(state.handleChkCompress), ID_CHK_COMPRESS) == BST_CHECKED);
+	settings.keyboardLayout = state.keyboardLayout;
 
-		// Set up the map, emitter, and parse the midi file.
-		// Parsing is probably one of the most likely parts to throw an error.
-		MidiMapper mapper(state.whitesOnly);
-		KeyboardEmitter emitter;
-		auto events = MidiFileParser::Parse(state.filePath);
+	// Get the transposition
+	std::string buf(256, '\0');
+	GetWindowTextA(state.handleEditTranspose, buf.data(), buf.size());
+	settings.transpose = 12 * stoi(buf);
+
+	// Thinning. Empty boxes are just 0 (no limit).
+	auto readInt = [](HWND edit) {
+		std::string text(16, '\0');
+		GetWindowTextA(edit, text.data(), text.size());
+		return atoi(text.c_str());
+	};
 
-		// Get the min and max, for if we compress
-		const int min = mapper.GetExtremeValue([](int a, int b) {return a < b; });
-		const int max = mapper.GetExtremeValue([](int a, int b) {return a > b; });
+	settings.thin.enabled = (IsDlgButtonChecked(GetParent(state.handleChkThin), ID_CHK_THIN) == BST_CHECKED);
+	settings.thin.maxKeys = readInt(state.handleEditMaxKeys);
+	settings.thin.minGapMs = readInt(state.handleEditMinGap);
+
+	// Channels & tracks. Blank plays everything.
+	auto readText = [](HWND edit) {
+		std::string text(256, '\0');
+		GetWindowTextA(edit, text.data(), text.size());
+		text.resize(strnlen(text.data(), text.size()));
+		return text;
+	};
 
-		// Wait 3 seconds.
-		Sleep(3000);
+	settings.filter.SetChannels(readText(state.handleEditChannels));
+	settings.filter.SetTracks(readText(state.handleEditTracks));
+	return settings;
+}
 
-		// Set text anticipatorily. That's not a word, I'm pretty sure. In anticipation.
-		SetWindowTextA(state.handleStatus, "Playing...");
+// Ask for the song in the file box to be got ready in the background, with the current settings.
+void RequestPreparse(AppState& state) {
+	std::string path(256, '\0');
+	GetWindowTextA(state.handleEdit, path.data(), path.size());
+	path.resize(strnlen(path.data(), path.size()));
 
-		// How often do you get to use a do while loop in programming? I find them pretty rare, all things considered...
-		do {
-			// Update
-			state.loop = (IsDlgButtonChecked(GetParent(state.handleChkLoop), ID_CHK_LOOP) == BST_CHECKED);
+	if (path.empty())
+		return;
 
-			// Set the start before we play the song.
-			// I forgot to move this into the do-while before and spent far too long figuring out the issue.
-			auto start = std::chrono::steady_clock::now();
+	try {
+		const bool diskCache = (IsDlgButtonChecked(GetParent(state.handleChkDiskCache), ID_CHK_DISK_CACHE) == BST_CHECKED);
+		state.preparser->Request(path, ReadCompileSettings(state), diskCache);
+	} catch (const std::exception&) {
+		// Bad transpose box or whatever. Play will complain about it properly.
+	}
+}
 
-			// Iterate through and play each event
-			for (auto const& e : events) {
-				// Stop early if requested
-				if (!state.playing) break;
+// Compile the current song with the current settings, and save it as a song pack.
+void ExportSongPack(AppState& state, const std::string& midiPath, const std::string& outPath) {
+	try {
+		const CompileSettings settings = ReadCompileSettings(state);
 
-				// Sleep intil the event
-				std::this_thread::sleep_until(start + std::chrono::milliseconds(e.timeMs));
+		MidiMapper mapper(*settings.layout);
+		KeyboardEmitter emitter(settings.keyboardLayout);
+		MappedFile file(midiPath);
 
-				// Transpose the note
-				int note = e.note + state.transpose;
+		if (SongPack::IsPack(file.Bytes()))
+			throw MidiFileException("That's already a song pack");
 
-				// Get the corresponding input to the event. If it exists, play it.
-				if (auto mapped = mapper.MapNote(note); mapped.has_value()) {
-					emitter.SendKey(*mapped, e.noteOn);
-					continue;
-				}
-				
-				if (!state.compress)
-					continue;
+		// Use the cached one if we've got it. Exporting after playing (or just picking the file) is instant then.
+		// No waiting on the preparser if it's still going: that'd freeze the window with no way out, so just compile it ourselves.
+		const SongCacheKey cacheKey = MakeCacheKey(settings, file);
+		SongCache::Schedule schedule = state.songCache.Find(cacheKey);
+		std::string thinSummary;
 
-				note = Compress(note, min, max);
+		if (!schedule) {
+			const ScheduleCompiler compiler(mapper, emitter, settings.transpose, settings.compress, settings.thin.enabled);
+			schedule = std::make_shared<const std::vector<ScheduledKey>>(CompileSong(file.Bytes(), compiler, settings, thinSummary));
+			state.songCache.Insert(cacheKey, schedule);
+		}
 
-				if (auto mapped = mapper.MapNote(note); mapped.has_value())
-					emitter.SendKey(*mapped, e.noteOn);
-			}
-		} while (state.loop && state.playing);
-	} catch (const std::exception& ex) { // ZOINKS!
+		if (!SongPack::Save(outPath, *schedule, settings.keyboardLayout))
+			throw MidiFileException("Failed to write song pack");
+
+		std::string status = "Exported " + std::to_string(schedule->size()) + " keys";
+		if (!thinSummary.empty())
+			status += ", " + thinSummary;
+		SetWindowTextA(state.handleStatus, (status + ".").c_str());
+	} catch (const std::exception& ex) {
 		SetWindowTextA(state.handleStatus, ex.what());
+	}
+}
 
-		// Re-enable the buttons.
-		EnableWindow(state.handleBtnPlay, TRUE);
-		EnableWindow(state.handleBtnLive, TRUE);
-		EnableWindow(state.handleBtnStop, FALSE);
+// A file in the same folder as the exe. Where the logs go.
+std::string NextToExe(const std::string& name) {
+	std::string path(MAX_PATH, '\0');
+	path.resize(GetModuleFileNameA(nullptr, path.data(), (DWORD)path.size()));
+	return path.substr(0, path.find_last_of("\\/") + 1) + name;
+}
+
+// The playback thread. Everything it plays with came off the UI before it started, in `job`,
+// and everything it says goes back by PostMessage or the transport's atomics, so it never waits on the message loop.
+void Play(std::stop_token stop, AppState& state, uint32_t session, const PlayJob& job) {
+	PlayContext ctx{state.songCache, state.preparser.get(), state.startTrigger, state.transport, state.loop,
+		[&](const std::string& text) { PostStatus(state, WM_APP_STATUS, session, text); }};
 
+	std::string summary;
+
+	// Put the playing and parsing inside a try/catch for "good enough" error handling
+	try {
+		KeyboardEmitter emitter(job.compile.keyboardLayout);
+		summary = PlaySong(stop, job, emitter, ctx);
+	} catch (const std::exception& ex) { // ZOINKS!
 		// So the message doesn't get overridden.
+		PostStatus(state, WM_APP_PLAY_DONE, session, ex.what());
+		return;
+	}
+
+	// The UI re-enables the buttons when it gets this.
+	PostStatus(state, WM_APP_PLAY_DONE, session, stop.stop_requested() ? "Stopped." : summary);
+}
+
+// Back on the UI thread: playback's over (finished, stopped, or blew up).
+void PlaybackDone(AppState& state, uint32_t session, const std::string& status) {
+	// From a playback that's already been replaced? Then this one's still going, leave it alone.
+	if (session != state.playSession)
 		return;
+
+	state.playing = false;
+
+	// Re-enable the buttons.
+	EnableWindow(state.handleBtnPlay, TRUE);
+	EnableWindow(state.handleBtnLive, TRUE);
+	EnableWindow(state.handleBtnStop, FALSE);
+	EnableWindow(state.handleBtnPause, FALSE);
+
+	SetWindowTextA(state.handleStatus, status.c_str());
+}
+
+// Stop listening for the game window. UI thread only.
+void UnhookFocus(AppState& state) {
+	if (state.focusHook) {
+		UnhookWinEvent(state.focusHook);
+		state.focusHook = nullptr;
 	}
+}
+
+// Something came to the front. If it's the game, go.
+void CALLBACK FocusHook(HWINEVENTHOOK, DWORD, HWND hwnd, LONG idObject, LONG, DWORD, DWORD) {
+	if (!hwnd || idObject != OBJID_WINDOW)
+		return;
+
+	std::wstring title(256, L'\0');
+	title.resize(GetWindowTextW(hwnd, title.data(), (int)title.size()));
 
-	// Re-enable the buttons.
-	EnableWindow(state.handleBtnPlay, TRUE);
-	EnableWindow(state.handleBtnLive, TRUE);
-	EnableWindow(state.handleBtnStop, FALSE);
+	if (title.find(L"Heartopia") == std::wstring::npos)
+		return;
 
-	// state.playing will be true if we finished, or false if we were stopped.
-	if (state.playing) {
-		state.playing = false;
-		//SetWindowTextA(state.handleStatus, "Done.");
-	} else {
-		SetWindowTextA(state.handleStatus, "Stopped.");
-	}
+	g_state->startTrigger.Fire();
+	UnhookFocus(*g_state);
 }
 
 void StartFilePlayback(AppState& state) {
@@ -646,46 +3722,112 @@ void StartFilePlayback(AppState& state) {
 		return;
 	}
 
+	// Read every setting here on the UI thread, into one snapshot the playback thread gets its own copy of.
+	// It doesn't touch the UI (or the rest of AppState's settings) at all. Loop's the exception, it's an atomic so it can change mid-song.
+	PlayJob job;
+	job.path = state.filePath;
+
+	try {
+		job.compile = ReadCompileSettings(state);
+	} catch (const std::exception& ex) {
+		SetWindowTextA(state.handleStatus, ex.what());
+		return;
+	}
+
+	state.precise = (IsDlgButtonChecked(GetParent(state.handleChkPrecise), ID_CHK_PRECISE) == BST_CHECKED);
+	state.diskCache = (IsDlgButtonChecked(GetParent(state.handleChkDiskCache), ID_CHK_DISK_CACHE) == BST_CHECKED);
+	state.loop = (IsDlgButtonChecked(GetParent(state.handleChkLoop), ID_CHK_LOOP) == BST_CHECKED);
+
+	job.precise = state.precise;
+	job.diskCache = state.diskCache;
+	if (state.latencyLog)
+		job.timingPath = NextToExe("timing.csv");
+
+	// Make sure the last one's completely gone first. It never waits on us, so this can't hang.
+	if (playThread.joinable()) {
+		playThread.request_stop();
+		playThread.join();
+	}
+
 	// Playing. Read line below for more details.
 	state.playing = true;
 
+	// Fresh transport.
+	state.transport.Reset();
+	state.rateKeys = 0;
+	state.rateTime = std::chrono::steady_clock::now();
+	SetWindowTextW(state.handleBtnPause, L"Pause");
+
 	// Set the buttons to active/inactive respectively.
 	EnableWindow(state.handleBtnPlay, FALSE);
 	EnableWindow(state.handleBtnLive, FALSE);
 	EnableWindow(state.handleBtnStop, TRUE);
+	EnableWindow(state.handleBtnPause, TRUE);
+
+	// Keep the seek bar & position up to date while it plays.
+	SetTimer(GetParent(state.handleStatus), ID_TMR_PROGRESS, 250, nullptr);
+
+	// Either start when the game comes to the front, or after the usual 3 seconds.
+	state.focusStart = (IsDlgButtonChecked(GetParent(state.handleChkFocusStart), ID_CHK_FOCUS_START) == BST_CHECKED);
+	if (state.focusStart)
+		job.countdown = std::nullopt;
+	state.startTrigger.Reset();
+	UnhookFocus(state);
+
+	if (state.focusStart) {
+		// Out of context, so the callback comes in on this thread's message loop. Our own windows don't count.
+		state.focusHook = SetWinEventHook(EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND, nullptr, FocusHook, 0, 0,
+			WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+		SetWindowTextA(state.handleStatus, "Playback starts when you switch to Heartopia...");
+	} else {
+		// We set the text here, but we start the timer in the Play function inside the thread, so we still have the UI on the main thread.
+		SetWindowTextA(state.handleStatus, "Playback in 3 seconds...");
+	}
+
+	// Start the thread. It gets its stop token from the jthread.
+	playThread = std::jthread(Play, std::ref(state), ++state.playSession, std::move(job));
+}
 
-	// We set the text here, but we start the timer in the Play function inside the thread, so we still have the UI on the main thread.
-	SetWindowTextA(state.handleStatus, "Playback in 3 seconds...");
+// Layout, transpose & compress as they are on the UI right now, as a live mapping. Throws if the transpose box is junk.
+std::unique_ptr<const MidiLiveInput::Mapping> ReadLiveMapping(AppState& state) {
+	// Check compress
+	state.compress = (IsDlgButtonChecked(GetParent(state.handleChkCompress), ID_CHK_COMPRESS) == BST_CHECKED);
 
-	// Start the thread.
-	playThread = std::jthread(Play, std::ref(state));
+	// Get the transposition
+	std::string buf(256, '\0');
+	GetWindowTextA(state.handleEditTranspose, buf.data(), buf.size());
+	state.transpose = 12 * stoi(buf);
+
+	return std::make_unique<const MidiLiveInput::Mapping>(state.layouts[state.layoutIndex].layout, state.transpose, state.compress);
 }
 
-void StartLiveInput(AppState& state) {
+// Something changed while live. Hand the input the new mapping, no restarting.
+void UpdateLiveMapping(AppState& state) {
+	if (!state.liveMode || !state.liveInput)
+		return;
+
 	try {
-		// Check whites only & compress
-		state.whitesOnly = (IsDlgButtonChecked(GetParent(state.handleChkWhites), ID_CHK_WHITES) == BST_CHECKED);
-		state.compress = (IsDlgButtonChecked(GetParent(state.handleChkCompress), ID_CHK_COMPRESS) == BST_CHECKED);
+		state.liveInput->SetMapping(ReadLiveMapping(state));
+	} catch (const std::exception&) {
+		// Half typed transpose ("-", say). Keep the old one until it's a number.
+	}
+}
 
-		// Get the transposition
-		std::string buf(256, '\0');
-		GetWindowTextA(g_state->handleEditTranspose, buf.data(), buf.size());
-		g_state->transpose = 12 * stoi(buf);
+void StartLiveInput(AppState& state) {
+	try {
+		state.liveEmitter = std::make_unique<KeyboardEmitter>(state.keyboardLayout);
+		state.liveInput = std::make_unique<MidiLiveInput>(*state.liveEmitter, ReadLiveMapping(state));
 
-		state.liveMapper = std::make_unique<MidiMapper>(state.whitesOnly);
-		state.liveEmitter = std::make_unique<KeyboardEmitter>();
-		state.liveInput = std::make_unique<MidiLiveInput>(*state.liveMapper, *state.liveEmitter, state.compress, state.transpose);
+		state.liveInput->Start(state.handleStatus, state.thruDevice);
 
-		state.liveInput->Start(state.handleStatus);
+		// Put the latency numbers on the status label every so often. Cheap, the histograms are just atomics.
+		SetTimer(GetParent(state.handleStatus), ID_TMR_LATENCY, 500, nullptr);
 
 		state.liveMode = true;
 		EnableWindow(state.handleBtnPlay, FALSE);
 		EnableWindow(state.handleBtnLive, FALSE);
-		EnableWindow(state.handleChkWhites, FALSE);
 		EnableWindow(state.handleChkLoop, FALSE);
-		EnableWindow(state.handleChkCompress, FALSE);
-		EnableWindow(state.handleEditTranspose, FALSE);
-		EnableWindow(state.handleSpinTranspose, FALSE);
+		EnableWindow(state.handleCmbThru, FALSE);
 		EnableWindow(state.handleBtnStop, TRUE);
 	} catch (const std::exception& ex) {
 		SetWindowTextA(state.handleStatus, ex.what());
@@ -695,28 +3837,71 @@ void StartLiveInput(AppState& state) {
 void Stop(AppState& state) {
 	if (state.playing) {
 		state.playing = false; // Signal the playback thread to exit
+
+		// Wakes it from whatever it's waiting on: the countdown, a pause, or the next note.
+		playThread.request_stop();
+		UnhookFocus(state);
 	}
 
 	if (state.liveMode) {
+		KillTimer(GetParent(state.handleStatus), ID_TMR_LATENCY);
+
 		// Clear and reset everything
 		state.liveInput->Stop(state.handleStatus);
+
+		// Dump the latency numbers next to the exe, if asked to.
+		if (state.latencyLog && state.liveInput->Latency().emit.Count() > 0) {
+			const std::string path = NextToExe("latency.csv");
+
+			std::string text = state.liveInput->Latency().WriteCsv(path) ? "Stopped. Latency log saved to " + path : "Stopped. Couldn't write latency log.";
+			SetWindowTextA(state.handleStatus, text.c_str());
+		}
+
 		state.liveInput.reset();
 		state.liveEmitter.reset();
-		state.liveMapper.reset();
 		state.liveMode = false;
 
 		// Re-enable the buttons.
 		EnableWindow(state.handleBtnPlay, TRUE);
 		EnableWindow(state.handleBtnLive, TRUE);
-		EnableWindow(state.handleChkWhites, TRUE);
 		EnableWindow(state.handleChkLoop, TRUE);
-		EnableWindow(state.handleChkCompress, TRUE);
-		EnableWindow(state.handleEditTranspose, TRUE);
-		EnableWindow(state.handleSpinTranspose, TRUE);
+		EnableWindow(state.handleCmbThru, TRUE);
 		EnableWindow(state.handleBtnStop, FALSE);
 	}
 }
 
+// Seek bar & "1:23 / 4:56", from what the playback thread's put in the atomics.
+void UpdateProgress(AppState& state) {
+	// Done? No point ticking anymore.
+	if (!state.playing)
+		KillTimer(GetParent(state.handleStatus), ID_TMR_PROGRESS);
+
+	const uint32_t position = state.transport.positionMs / 1000;
+	const uint32_t duration = state.transport.durationMs / 1000;
+
+	EnableWindow(state.handleTrackSeek, state.playing && state.transport.seekable);
+	SendMessage(state.handleTrackSeek, TBM_SETRANGEMAX, FALSE, duration);
+
+	// Don't yank it out from under the mouse mid-drag.
+	if (GetCapture() != state.handleTrackSeek)
+		SendMessage(state.handleTrackSeek, TBM_SETPOS, TRUE, position);
+
+	// Keys a second since the last tick. Only when it's actually playing, so a pause or the countdown just shows the time.
+	const auto now = std::chrono::steady_clock::now();
+	const uint64_t keys = state.transport.keysSent.load(std::memory_order_relaxed);
+	const double seconds = std::chrono::duration<double>(now - state.rateTime).count();
+	const double rate = keys >= state.rateKeys && seconds > 0 ? (keys - state.rateKeys) / seconds : 0;
+	state.rateKeys = keys;
+	state.rateTime = now;
+
+	char buf[64];
+	if (state.playing && !state.transport.paused && rate > 0)
+		snprintf(buf, sizeof(buf), "%u:%02u / %u:%02u, %.0f keys/s", position / 60, position % 60, duration / 60, duration % 60, rate);
+	else
+		snprintf(buf, sizeof(buf), "%u:%02u / %u:%02u", position / 60, position % 60, duration / 60, duration % 60);
+	SetWindowTextA(state.handlePosition, buf);
+}
+
 // Create the UI
 LRESULT CALLBACK Create(HWND hwnd, LPARAM lParam) {
 	// Load DLLs for updown spin
@@ -724,6 +3909,7 @@ LRESULT CALLBACK Create(HWND hwnd, LPARAM lParam) {
 
 	// Get the HInstance
 	HINSTANCE hInst = ((LPCREATESTRUCT)lParam)->hInstance;
+	g_state->handleWindow = hwnd;
 
 	// File selector
 	CreateWindowW(L"STATIC", L"MIDI File:",
@@ -739,10 +3925,16 @@ LRESULT CALLBACK Create(HWND hwnd, LPARAM lParam) {
 		475, 10, 80, 24, hwnd, (HMENU)ID_BTN_BROWSE, hInst, nullptr);
 
 
+	// Layout picker. The height's how far the list drops down.
+	g_state->handleCmbLayout = CreateWindowW(L"COMBOBOX", nullptr,
+		WS_CHILD | WS_VISIBLE | WS_VSCROLL | CBS_DROPDOWNLIST,
+		10, 45, 160, 200, hwnd, (HMENU)ID_CMB_LAYOUT, hInst, nullptr);
+
+	for (size_t i = 0; i < g_state->layouts.Count(); ++i)
+		SendMessageA(g_state->handleCmbLayout, CB_ADDSTRING, 0, (LPARAM)g_state->layouts[i].name.c_str());
+	SendMessage(g_state->handleCmbLayout, CB_SETCURSEL, g_state->layoutIndex, 0);
+
 	// Checkboxes
-	g_state->handleChkWhites = CreateWindowW(L"BUTTON", L"15 keys (Double Row)",
-		WS_CHILD | WS_VISIBLE | BS_CHECKBOX,
-		10, 45, 160, 24, hwnd, (HMENU)ID_CHK_WHITES, hInst, nullptr);
 
 	g_state->handleChkLoop = CreateWindowW(L"BUTTON", L"Loop",
 		WS_CHILD | WS_VISIBLE | BS_CHECKBOX,
@@ -782,15 +3974,110 @@ LRESULT CALLBACK Create(HWND hwnd, LPARAM lParam) {
 		WS_CHILD | WS_VISIBLE,
 		210, 80, 90, 28, hwnd, (HMENU)ID_BTN_STOP, hInst, nullptr);
 
+	g_state->handleBtnPause = CreateWindowW(L"BUTTON", L"Pause",
+		WS_CHILD | WS_VISIBLE,
+		310, 80, 90, 28, hwnd, (HMENU)ID_BTN_PAUSE, hInst, nullptr);
+
+	g_state->handleBtnExport = CreateWindowW(L"BUTTON", L"Export...",
+		WS_CHILD | WS_VISIBLE,
+		465, 80, 90, 28, hwnd, (HMENU)ID_BTN_EXPORT, hInst, nullptr);
+
+
+	// Options
+	g_state->handleChkPrecise = CreateWindowW(L"BUTTON", L"Precise timing",
+		WS_CHILD | WS_VISIBLE | BS_CHECKBOX,
+		10, 115, 120, 24, hwnd, (HMENU)ID_CHK_PRECISE, hInst, nullptr);
+
+	// On by default. It's the whole point.
+	CheckDlgButton(hwnd, ID_CHK_PRECISE, g_state->precise ? BST_CHECKED : BST_UNCHECKED);
+
+	g_state->handleChkLatencyLog = CreateWindowW(L"BUTTON", L"Log latency",
+		WS_CHILD | WS_VISIBLE | BS_CHECKBOX,
+		140, 115, 110, 24, hwnd, (HMENU)ID_CHK_LATENCY_LOG, hInst, nullptr);
+
+	g_state->handleChkDiskCache = CreateWindowW(L"BUTTON", L"Cache to disk",
+		WS_CHILD | WS_VISIBLE | BS_CHECKBOX,
+		260, 115, 120, 24, hwnd, (HMENU)ID_CHK_DISK_CACHE, hInst, nullptr);
+
+	g_state->handleChkFocusStart = CreateWindowW(L"BUTTON", L"Start on game focus",
+		WS_CHILD | WS_VISIBLE | BS_CHECKBOX,
+		390, 115, 165, 24, hwnd, (HMENU)ID_CHK_FOCUS_START, hInst, nullptr);
+
+	// Thinning, for black MIDIs
+	g_state->handleChkThin = CreateWindowW(L"BUTTON", L"Thin notes",
+		WS_CHILD | WS_VISIBLE | BS_CHECKBOX,
+		10, 150, 95, 24, hwnd, (HMENU)ID_CHK_THIN, hInst, nullptr);
+
+	CreateWindowW(L"STATIC", L"Max keys",
+		WS_CHILD | WS_VISIBLE,
+		110, 153, 60, 20, hwnd, nullptr, hInst, nullptr);
+
+	g_state->handleEditMaxKeys = CreateWindowW(L"Edit", L"10",
+		WS_CHILD | WS_VISIBLE | WS_BORDER | ES_NUMBER,
+		170, 150, 40, 24, hwnd, (HMENU)ID_EDIT_MAX_KEYS, hInst, nullptr);
+
+	CreateWindowW(L"STATIC", L"Min gap (ms)",
+		WS_CHILD | WS_VISIBLE,
+		225, 153, 85, 20, hwnd, nullptr, hInst, nullptr);
+
+	g_state->handleEditMinGap = CreateWindowW(L"Edit", L"20",
+		WS_CHILD | WS_VISIBLE | WS_BORDER | ES_NUMBER,
+		310, 150, 40, 24, hwnd, (HMENU)ID_EDIT_MIN_GAP, hInst, nullptr);
+
+	// MIDI thru, for hearing live input on a synth. Picked before going live.
+	CreateWindowW(L"STATIC", L"MIDI thru",
+		WS_CHILD | WS_VISIBLE,
+		365, 153, 60, 20, hwnd, nullptr, hInst, nullptr);
+
+	g_state->handleCmbThru = CreateWindowW(L"COMBOBOX", nullptr,
+		WS_CHILD | WS_VISIBLE | WS_VSCROLL | CBS_DROPDOWNLIST,
+		430, 150, 125, 200, hwnd, (HMENU)ID_CMB_THRU, hInst, nullptr);
+
+	SendMessageA(g_state->handleCmbThru, CB_ADDSTRING, 0, (LPARAM)"Off");
+	for (UINT id = 0, count = midiOutGetNumDevs(); id < count; ++id)
+		SendMessageA(g_state->handleCmbThru, CB_ADDSTRING, 0, (LPARAM)MidiLiveInput::OutputName(id).c_str());
+	SendMessage(g_state->handleCmbThru, CB_SETCURSEL, 0, 0);
+
+	// Which channels & tracks to play, e.g. "!10" for no drums. Blank is everything.
+	CreateWindowW(L"STATIC", L"Channels",
+		WS_CHILD | WS_VISIBLE,
+		10, 188, 60, 20, hwnd, nullptr, hInst, nullptr);
+
+	g_state->handleEditChannels = CreateWindowW(L"Edit", L"",
+		WS_CHILD | WS_VISIBLE | WS_BORDER | ES_AUTOHSCROLL,
+		75, 185, 110, 24, hwnd, (HMENU)ID_EDIT_CHANNELS, hInst, nullptr);
+
+	CreateWindowW(L"STATIC", L"Tracks",
+		WS_CHILD | WS_VISIBLE,
+		200, 188, 45, 20, hwnd, nullptr, hInst, nullptr);
+
+	g_state->handleEditTracks = CreateWindowW(L"Edit", L"",
+		WS_CHILD | WS_VISIBLE | WS_BORDER | ES_AUTOHSCROLL,
+		250, 185, 110, 24, hwnd, (HMENU)ID_EDIT_TRACKS, hInst, nullptr);
+
+	CreateWindowW(L"BUTTON", L"List tracks...",
+		WS_CHILD | WS_VISIBLE,
+		375, 184, 110, 26, hwnd, (HMENU)ID_BTN_TRACKS, hInst, nullptr);
+
+	// Seek bar & position. Seconds, so the range doesn't get silly on long songs.
+	g_state->handleTrackSeek = CreateWindowW(TRACKBAR_CLASS, L"",
+		WS_CHILD | WS_VISIBLE | TBS_HORZ | TBS_NOTICKS,
+		10, 220, 370, 28, hwnd, (HMENU)ID_TRK_SEEK, hInst, nullptr);
+
+	g_state->handlePosition = CreateWindowW(L"STATIC", L"0:00 / 0:00",
+		WS_CHILD | WS_VISIBLE,
+		390, 225, 170, 20, hwnd, (HMENU)ID_LBL_POSITION, hInst, nullptr);
 
 	// Disable until playing
 	EnableWindow(g_state->handleBtnStop, FALSE);
+	EnableWindow(g_state->handleBtnPause, FALSE);
+	EnableWindow(g_state->handleTrackSeek, FALSE);
 
 
 	// Status label
 	g_state->handleStatus = CreateWindowW(L"STATIC", L"Ready.",
 		WS_CHILD | WS_VISIBLE,
-		10, 120, 540, 20, hwnd, (HMENU)ID_LBL_STATUS, hInst, nullptr);
+		10, 260, 540, 20, hwnd, (HMENU)ID_LBL_STATUS, hInst, nullptr);
 
 
 	return 0;
@@ -806,7 +4093,7 @@ LRESULT CALLBACK Command(WPARAM wParam, HWND hwnd) {
 			OPENFILENAMEA ofn{};
 			ofn.lStructSize = sizeof(ofn);
 			ofn.hwndOwner = hwnd;
-			ofn.lpstrFilter = "MIDI Files\0*.mid;*.midi\0All Files\0*.*\0";
+			ofn.lpstrFilter = "MIDI Files & Song Packs\0*.mid;*.midi;*.hmps\0All Files\0*.*\0";
 			ofn.lpstrFile = buf;
 			ofn.nMaxFile = sizeof(buf);
 			ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
@@ -814,15 +4101,95 @@ LRESULT CALLBACK Command(WPARAM wParam, HWND hwnd) {
 			if (GetOpenFileNameA(&ofn)) {
 				SetWindowTextA(g_state->handleEdit, buf);
 				g_state->filePath = buf;
+
+				// Picked, not typed, so no need to wait for more keystrokes. Start on it now.
+				KillTimer(hwnd, ID_TMR_PREPARSE);
+				RequestPreparse(*g_state);
+			}
+
+			break;
+		}
+
+		// What's in the file, so you know what to put in the track & channel boxes.
+		case ID_BTN_TRACKS:
+		{
+			std::string midiPath(256, '\0');
+			GetWindowTextA(g_state->handleEdit, midiPath.data(), midiPath.size());
+			midiPath.resize(strnlen(midiPath.data(), midiPath.size()));
+
+			if (midiPath.empty()) {
+				SetWindowTextA(g_state->handleStatus, "No file selected.");
+				break;
+			}
+
+			try {
+				MappedFile file(midiPath);
+				if (SongPack::IsPack(file.Bytes()))
+					throw MidiFileException("Song packs don't have tracks anymore, they're already baked");
+
+				MessageBoxA(hwnd, DescribeTracks(file.Bytes(), 40).c_str(), "Tracks", MB_OK);
+			} catch (const std::exception& ex) {
+				SetWindowTextA(g_state->handleStatus, ex.what());
+			}
+
+			break;
+		}
+
+		// Save the current song as a song pack
+		case ID_BTN_EXPORT:
+		{
+			std::string midiPath(256, '\0');
+			GetWindowTextA(g_state->handleEdit, midiPath.data(), midiPath.size());
+			midiPath.resize(strnlen(midiPath.data(), midiPath.size()));
+
+			if (midiPath.empty()) {
+				SetWindowTextA(g_state->handleStatus, "No file selected.");
+				break;
 			}
 
+			// Suggest the same name, with the pack extension.
+			char buf[MAX_PATH] = {};
+			std::string suggested = midiPath.substr(0, midiPath.find_last_of('.')) + ".hmps";
+			strncpy(buf, suggested.c_str(), sizeof(buf) - 1);
+
+			OPENFILENAMEA ofn{};
+			ofn.lStructSize = sizeof(ofn);
+			ofn.hwndOwner = hwnd;
+			ofn.lpstrFilter = "Song Packs\0*.hmps\0All Files\0*.*\0";
+			ofn.lpstrFile = buf;
+			ofn.nMaxFile = sizeof(buf);
+			ofn.lpstrDefExt = "hmps";
+			ofn.Flags = OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST;
+
+			if (GetSaveFileNameA(&ofn))
+				ExportSongPack(*g_state, midiPath, buf);
+
 			break;
 		}
 
-		case ID_CHK_WHITES:
-			// Toggle the checkbox state
-			g_state->whitesOnly = !(IsDlgButtonChecked(hwnd, ID_CHK_WHITES) == BST_CHECKED);
-			CheckDlgButton(hwnd, ID_CHK_WHITES, g_state->whitesOnly ? BST_CHECKED : BST_UNCHECKED);
+		// Typing a path in? Get it ready once they've stopped typing for a bit.
+		case ID_EDIT_FILE:
+			if (HIWORD(wParam) == EN_CHANGE)
+				SetTimer(hwnd, ID_TMR_PREPARSE, 400, nullptr);
+			break;
+
+		case ID_CMB_LAYOUT:
+			// Every layout's already built, so switching is just remembering which one.
+			if (HIWORD(wParam) == CBN_SELCHANGE) {
+				LRESULT selected = SendMessage(g_state->handleCmbLayout, CB_GETCURSEL, 0, 0);
+				if (selected >= 0 && (size_t)selected < g_state->layouts.Count())
+					g_state->layoutIndex = (size_t)selected;
+
+				UpdateLiveMapping(*g_state);
+			}
+			break;
+
+		case ID_CMB_THRU:
+			// "Off" first, then the outputs in ID order.
+			if (HIWORD(wParam) == CBN_SELCHANGE) {
+				LRESULT selected = SendMessage(g_state->handleCmbThru, CB_GETCURSEL, 0, 0);
+				g_state->thruDevice = selected > 0 ? std::optional<UINT>((UINT)selected - 1) : std::nullopt;
+			}
 			break;
 
 		case ID_CHK_LOOP:
@@ -835,6 +4202,58 @@ LRESULT CALLBACK Command(WPARAM wParam, HWND hwnd) {
 			// Toggle the checkbox state. Same code as above.
 			g_state->compress = !(IsDlgButtonChecked(hwnd, ID_CHK_COMPRESS) == BST_CHECKED);
 			CheckDlgButton(hwnd, ID_CHK_COMPRESS, g_state->compress ? BST_CHECKED : BST_UNCHECKED);
+			UpdateLiveMapping(*g_state);
+			break;
+
+		// Typed in, or the spinner (which types in for us). Live input picks it up straight away.
+		case ID_EDIT_TRANSPOSE:
+			if (HIWORD(wParam) == EN_CHANGE)
+				UpdateLiveMapping(*g_state);
+			break;
+
+		case ID_CHK_PRECISE:
+			// Toggle the checkbox state. Same code as above.
+			g_state->precise = !(IsDlgButtonChecked(hwnd, ID_CHK_PRECISE) == BST_CHECKED);
+			CheckDlgButton(hwnd, ID_CHK_PRECISE, g_state->precise ? BST_CHECKED : BST_UNCHECKED);
+			break;
+
+		case ID_CHK_LATENCY_LOG:
+			// Toggle the checkbox state. Same code as above.
+			g_state->latencyLog = !(IsDlgButtonChecked(hwnd, ID_CHK_LATENCY_LOG) == BST_CHECKED);
+			CheckDlgButton(hwnd, ID_CHK_LATENCY_LOG, g_state->latencyLog ? BST_CHECKED : BST_UNCHECKED);
+			break;
+
+		case ID_CHK_DISK_CACHE:
+			// Toggle the checkbox state. Same code as above.
+			g_state->diskCache = !(IsDlgButtonChecked(hwnd, ID_CHK_DISK_CACHE) == BST_CHECKED);
+			CheckDlgButton(hwnd, ID_CHK_DISK_CACHE, g_state->diskCache ? BST_CHECKED : BST_UNCHECKED);
+			break;
+
+		case ID_BTN_PAUSE:
+			if (!g_state->playing)
+				break;
+
+			// The playback thread lets go of the keys, and waits for this to flip back.
+			{
+				std::scoped_lock lock(g_state->transport.mutex);
+				g_state->transport.paused = !g_state->transport.paused;
+			}
+			g_state->transport.changed.notify_all();
+
+			SetWindowTextW(g_state->handleBtnPause, g_state->transport.paused ? L"Resume" : L"Pause");
+			SetWindowTextA(g_state->handleStatus, g_state->transport.paused ? "Paused." : "Playing...");
+			break;
+
+		case ID_CHK_FOCUS_START:
+			// Toggle the checkbox state. Same code as above.
+			g_state->focusStart = !(IsDlgButtonChecked(hwnd, ID_CHK_FOCUS_START) == BST_CHECKED);
+			CheckDlgButton(hwnd, ID_CHK_FOCUS_START, g_state->focusStart ? BST_CHECKED : BST_UNCHECKED);
+			break;
+
+		case ID_CHK_THIN:
+			// Toggle the checkbox state. Same code as above.
+			g_state->thin = !(IsDlgButtonChecked(hwnd, ID_CHK_THIN) == BST_CHECKED);
+			CheckDlgButton(hwnd, ID_CHK_THIN, g_state->thin ? BST_CHECKED : BST_UNCHECKED);
 			break;
 
 		case ID_BTN_PLAY:
@@ -877,10 +4296,66 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
 			}
 			break;
 
+		case WM_TIMER:
+			if (wParam == ID_TMR_PROGRESS) {
+				UpdateProgress(*g_state);
+				return 0;
+			}
+
+			if (wParam == ID_TMR_PREPARSE) {
+				KillTimer(hwnd, ID_TMR_PREPARSE);
+				RequestPreparse(*g_state);
+				return 0;
+			}
+
+			// Live latency readout. Leave "Listening..." up until there's actually something to show.
+			if (wParam == ID_TMR_LATENCY && g_state->liveInput && g_state->liveInput->Latency().emit.Count() > 0) {
+				SetWindowTextA(g_state->handleStatus, g_state->liveInput->Latency().Summary().c_str());
+				return 0;
+			}
+			break;
+
+		case WM_APP_STATUS:
+		case WM_APP_PLAY_DONE:
+		case WM_APP_PREPARSED:
+		{
+			std::unique_ptr<std::string> text((std::string*)lParam);
+
+			if (msg == WM_APP_PLAY_DONE)
+				PlaybackDone(*g_state, (uint32_t)wParam, *text);
+			else if (msg == WM_APP_STATUS && (uint32_t)wParam == g_state->playSession)
+				SetWindowTextA(g_state->handleStatus, text->c_str());
+			else if (msg == WM_APP_PREPARSED && !g_state->playing && !g_state->liveMode)
+				SetWindowTextA(g_state->handleStatus, text->c_str());
+			return 0;
+		}
+
+		case WM_HSCROLL: // Seek bar. Only seek once it's let go of, rather than on every pixel of a drag.
+			if ((HWND)(lParam) == g_state->handleTrackSeek && LOWORD(wParam) == TB_ENDTRACK) {
+				if (g_state->playing && g_state->transport.seekable)
+					g_state->transport.seekMs = (int64_t)SendMessage(g_state->handleTrackSeek, TBM_GETPOS, 0, 0) * 1000;
+				return 0;
+			}
+			break;
+
+		case WM_INPUTLANGCHANGE:
+			// Keyboard layout changed, so the scancodes did too. Remember it for new emitters, and fix up the live one.
+			g_state->keyboardLayout = (HKL)lParam;
+			if (g_state->liveEmitter)
+				g_state->liveEmitter->RefreshLayout((HKL)lParam);
+			break;
+
 		case WM_DESTROY:
 			// Clean up if still running
 			if (g_state->playing || g_state->liveMode)
 				Stop(*g_state);
+
+			// Wait for the playback thread to actually go, since it's using the AppState that WinMain's about to drop.
+			// It only ever posts to us, never waits on us, so this can't hang.
+			if (playThread.joinable()) {
+				playThread.request_stop();
+				playThread.join();
+			}
 			PostQuitMessage(0);
 			return 0;
 
@@ -890,10 +4365,199 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
 	return DefWindowProcW(hwnd, msg, wParam, lParam);
 }
 
+// Command line mode. Same engine as the window, no window, e.g.
+//   HeartopiaMidiPlayer.exe --play song.mid --layout 15 --transpose -1 --compress --dry-run
+// For scripting, and for checking what a song turns into without a game open.
+static const char* cliUsage =
+	"Usage: HeartopiaMidiPlayer --play FILE [options]\n"
+	"  --layout NAME       Key layout: 22, 15 (double row), or a name from layouts.ini. Default 22.\n"
+	"  --list-layouts      Print every layout's name.\n"
+	"  --transpose N       Octaves up (or down, if negative).\n"
+	"  --compress          Fold out of range notes into range.\n"
+	"  --thin              Thin notes. --max-keys N and --min-gap MS as in the window.\n"
+	"  --channels LIST     Only play these channels, e.g. 1-4,6, or !10 for all but 10.\n"
+	"  --tracks LIST       Only play these tracks, same format.\n"
+	"  --list-tracks       Print every track in the --play file, with its note count & channels.\n"
+	"  --loop              Play forever (until Ctrl+C).\n"
+	"  --standard          Standard timing instead of precise.\n"
+	"  --countdown MS      Wait before playing. Default 3000.\n"
+	"  --cache             Use the .hmpcache disk cache.\n"
+	"  --timing FILE       Save every chord's scheduled vs actual timing to FILE (csv).\n"
+	"  --dry-run           Don't press anything, print the keys that would've been pressed, with timestamps.\n";
+
+// Ctrl+C stops playback (and lets go of the keys) instead of killing us mid-chord.
+static std::stop_source g_cliStop;
+
+static BOOL WINAPI CliCtrlHandler(DWORD type) {
+	if (type != CTRL_C_EVENT && type != CTRL_BREAK_EVENT && type != CTRL_CLOSE_EVENT)
+		return FALSE;
+
+	g_cliStop.request_stop();
+	return TRUE;
+}
+
+// Exit codes: 0 done, 1 error, 2 bad arguments, 130 stopped.
+static int RunCli(int argc, char** argv) {
+	PlayJob job;
+	job.compile.keyboardLayout = GetKeyboardLayout(0);
+	job.compile.thin.maxKeys = 10;
+	job.compile.thin.minGapMs = 20;
+
+	bool dryRun = false;
+	bool listTracks = false;
+	std::atomic<bool> loop = false;
+
+	// Layouts first, so --layout can find the ones from the file.
+	LayoutLibrary layouts;
+	layouts.LoadFile(NextToExe("layouts.ini"));
+	if (!layouts.Error().empty())
+		fprintf(stderr, "%s\n", layouts.Error().c_str());
+
+	auto fail = [](const char* what, const char* arg) {
+		fprintf(stderr, "%s: %s\n\n%s", what, arg, cliUsage);
+		return 2;
+	};
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string_view arg = argv[i];
+
+		// Flags that take a value.
+		if (arg == "--play" || arg == "--timing" || arg == "--layout" || arg == "--transpose" || arg == "--max-keys" ||
+			arg == "--min-gap" || arg == "--countdown" || arg == "--channels" || arg == "--tracks") {
+			if (i + 1 >= argc)
+				return fail("Missing value for", argv[i]);
+
+			const char* value = argv[++i];
+			char* end = nullptr;
+			const long number = strtol(value, &end, 10);
+			const bool isNumber = end != value && *end == '\0';
+
+			if (arg == "--play")
+				job.path = value;
+			else if (arg == "--timing")
+				job.timingPath = value;
+			else if (arg == "--layout" && layouts.Find(value))
+				job.compile.layout = &layouts[*layouts.Find(value)].layout;
+			else if (arg == "--layout" && (std::string_view(value) == "15" || std::string_view(value) == "22"))
+				job.compile.layout = std::string_view(value) == "15" ? &whitesLayout : &fullLayout;
+			else if (arg == "--transpose" && isNumber)
+				job.compile.transpose = (int)number * 12;
+			else if (arg == "--max-keys" && isNumber && number >= 0 && number <= INT_MAX)
+				job.compile.thin.maxKeys = (int)number;
+			else if (arg == "--min-gap" && isNumber && number >= 0 && number <= INT_MAX)
+				job.compile.thin.minGapMs = (int)number;
+			else if (arg == "--countdown" && isNumber && number >= 0)
+				job.countdown = std::chrono::milliseconds(number);
+			else if (arg == "--channels" || arg == "--tracks") {
+				try {
+					if (arg == "--channels")
+						job.compile.filter.SetChannels(value);
+					else
+						job.compile.filter.SetTracks(value);
+				} catch (const std::exception&) {
+					return fail("Bad value", value);
+				}
+			} else
+				return fail("Bad value", value);
+
+			continue;
+		}
+
+		if (arg == "--compress")
+			job.compile.compress = true;
+		else if (arg == "--thin")
+			job.compile.thin.enabled = true;
+		else if (arg == "--loop")
+			loop = true;
+		else if (arg == "--standard")
+			job.precise = false;
+		else if (arg == "--cache")
+			job.diskCache = true;
+		else if (arg == "--dry-run")
+			dryRun = true;
+		else if (arg == "--list-tracks")
+			listTracks = true;
+		else if (arg == "--list-layouts") {
+			for (size_t l = 0; l < layouts.Count(); ++l)
+				printf("%s\n", layouts[l].name.c_str());
+			return 0;
+		}
+		else if (arg == "--help" || arg == "-h" || arg == "/?") {
+			fputs(cliUsage, stdout);
+			return 0;
+		} else
+			return fail("Unknown option", argv[i]);
+	}
+
+	if (job.path.empty())
+		return fail("Nothing to play", "use --play FILE");
+
+	if (listTracks) {
+		try {
+			MappedFile file(job.path);
+			fputs(DescribeTracks(file.Bytes()).c_str(), stdout);
+			return 0;
+		} catch (const std::exception& ex) {
+			fprintf(stderr, "%s\n", ex.what());
+			return 1;
+		}
+	}
+
+	SetConsoleCtrlHandler(CliCtrlHandler, TRUE);
+
+	// Everything the window would normally own. No preparser, since there's nothing to get ready ahead of.
+	SongCache cache;
+	StartTrigger trigger;
+	Transport transport;
+	PlayContext ctx{cache, nullptr, trigger, transport, loop,
+		[](const std::string& text) { fprintf(stderr, "%s\n", text.c_str()); }};
+
+	// Status goes to stderr, so --dry-run output can be piped somewhere on its own.
+	std::optional<DryRunEmitter> dryRunEmitter;
+	std::optional<KeyboardEmitter> realEmitter;
+	const KeyboardEmitter& emitter = dryRun
+		? (const KeyboardEmitter&)dryRunEmitter.emplace(job.compile.keyboardLayout)
+		: realEmitter.emplace(job.compile.keyboardLayout);
+
+	std::string summary;
+	try {
+		summary = PlaySong(g_cliStop.get_token(), job, emitter, ctx);
+	} catch (const std::exception& ex) {
+		fprintf(stderr, "%s\n", ex.what());
+		return 1;
+	}
+
+	if (dryRunEmitter) {
+		dryRunEmitter->Write(stdout);
+		fflush(stdout);
+	}
+
+	const bool stopped = g_cliStop.stop_requested();
+	fprintf(stderr, "%s\n", stopped ? "Stopped." : summary.c_str());
+	return stopped ? 130 : 0;
+}
+
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
+	// Any arguments at all means command line mode. We're a GUI app, so borrow the console we were run from (or make one).
+	if (__argc > 1) {
+		if (!AttachConsole(ATTACH_PARENT_PROCESS))
+			AllocConsole();
+		FILE* console = nullptr;
+		freopen_s(&console, "CONOUT$", "w", stdout);
+		freopen_s(&console, "CONOUT$", "w", stderr);
+		return RunCli(__argc, __argv);
+	}
+
 	// Tracks our variables for us...
 	AppState state{};
 	g_state = &state;
+	state.keyboardLayout = GetKeyboardLayout(0);
+	state.layouts.LoadFile(NextToExe("layouts.ini"));
+
+	// Background song prep. Reports go to the UI thread like the playback thread's do.
+	state.preparser = std::make_unique<Preparser>(state.songCache, [&state](std::string text) {
+		PostStatus(state, WM_APP_PREPARSED, 0, std::move(text));
+	});
 
 	// Register window class
 	WNDCLASSEXW wc{};
@@ -912,11 +4576,15 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
 		L"Heartopia MIDI Player",
 		WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_MINIMIZEBOX, // Fixed size
 		CW_USEDEFAULT, CW_USEDEFAULT,
-		580, 190,
+		580, 330,
 		nullptr, nullptr,
 		hInstance, nullptr
 	);
 
+	// Something off in layouts.ini? Say so, rather than the layout just quietly missing from the list.
+	if (!state.layouts.Error().empty())
+		SetWindowTextA(state.handleStatus, state.layouts.Error().c_str());
+
 	ShowWindow(hwnd, nCmdShow);
 	UpdateWindow(hwnd);
 
@@ -930,7 +4598,314 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
 	return 0;
 }
 
-// If input is main instead of WinMain, just use WinMain anyway.
+#ifdef HEARTOPIA_BENCHMARK
+// Microbenchmarks. Build as a console app with HEARTOPIA_BENCHMARK defined, and main runs these instead of the UI.
+// Nothing in here ships in the normal build.
+
+// The old per-event walk from tick 0, kept only as the baseline to race against.
+static uint64_t NaiveTickToUs(uint32_t tick, const std::vector<TempoMap::TempoChange>& tempoMap, uint16_t tpqn) {
+	uint64_t us = 0;
+	uint32_t lastTick = 0;
+	uint32_t currentTempo = 500000;
+
+	for (const auto& tc : tempoMap) {
+		if (tc.tick >= tick) break;
+		us += (uint64_t)(tc.tick - lastTick) * currentTempo / tpqn;
+		lastTick = tc.tick;
+		currentTempo = tc.tempo;
+	}
+
+	return us + (uint64_t)(tick - lastTick) * currentTempo / tpqn;
+}
+
+// Time a callable, in milliseconds. Returns whatever it summed so the optimiser can't just delete the work.
+template <typename F>
+static double TimeMs(F&& work, uint64_t& sink) {
+	auto begin = std::chrono::steady_clock::now();
+	sink = work();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// Best of a few runs, since the first one's always paying for page faults & cold caches.
+template <typename F>
+static double BestMs(int runs, F&& work, uint64_t& sink) {
+	double best = 0;
+	for (int i = 0; i < runs; ++i) {
+		double ms = TimeMs(work, sink);
+		best = i == 0 ? ms : std::min(best, ms);
+	}
+	return best;
+}
+
+// Tiny LCG. Deterministic, so every run (and every machine) benchmarks the exact same file.
+struct BenchRandom {
+	uint32_t state;
+	uint32_t Next(uint32_t bound) {
+		state = state * 1664525u + 1013904223u;
+		return (state >> 8) % bound;
+	}
+};
+
+static void PutVar(std::vector<uint8_t>& out, uint32_t value) {
+	uint8_t bytes[5];
+	int n = 0;
+	do {
+		bytes[n++] = value & 0x7F;
+		value >>= 7;
+	} while (value);
+
+	while (n > 1)
+		out.push_back(bytes[--n] | 0x80);
+	out.push_back(bytes[0]);
+}
+
+static void PutBig(std::vector<uint8_t>& out, uint32_t value, int bytes) {
+	while (bytes--)
+		out.push_back((uint8_t)(value >> (bytes * 8)));
+}
+
+struct SyntheticSong {
+	const char* name;
+	uint16_t tracks;
+	uint32_t notesPerTrack;
+	uint32_t tempoChanges;
+	uint32_t sysexBytes; // Every 256 notes. 0 for none.
+};
+
+// A made up worst case: a tempo track with a change every few ticks, then note tracks that are nothing but running status
+// note on/offs (offs as velocity 0, like most exporters), with the odd control change breaking the run and fat SysEx blobs in between.
+static std::vector<uint8_t> SyntheticMidi(const SyntheticSong& song) {
+	constexpr uint16_t tpqn = 480;
+	BenchRandom random{song.tracks * 7919u + song.notesPerTrack};
+	std::vector<uint8_t> out;
+
+	auto track = [&](auto body) {
+		out.insert(out.end(), {'M', 'T', 'r', 'k', 0, 0, 0, 0});
+		const size_t start = out.size();
+		body();
+		out.insert(out.end(), {0x00, 0xFF, 0x2F, 0x00});
+
+		const uint32_t length = (uint32_t)(out.size() - start);
+		for (int i = 0; i < 4; ++i)
+			out[start - 4 + i] = (uint8_t)(length >> (24 - i * 8));
+	};
+
+	out.insert(out.end(), {'M', 'T', 'h', 'd'});
+	PutBig(out, 6, 4);
+	PutBig(out, 1, 2);
+	PutBig(out, song.tracks + 1u, 2);
+	PutBig(out, tpqn, 2);
+
+	// Tempo track.
+	track([&] {
+		for (uint32_t i = 0; i < song.tempoChanges; ++i) {
+			PutVar(out, 1 + random.Next(60));
+			out.insert(out.end(), {0xFF, 0x51, 0x03});
+			PutBig(out, 300000 + random.Next(400000), 3);
+		}
+	});
+
+	for (uint16_t t = 0; t < song.tracks; ++t) {
+		track([&] {
+			const uint8_t channel = t % 16;
+			bool running = false;
+
+			for (uint32_t i = 0; i < song.notesPerTrack; ++i) {
+				if (song.sysexBytes && i % 256 == 255) {
+					PutVar(out, 0);
+					out.push_back(0xF0);
+					PutVar(out, song.sysexBytes);
+					for (uint32_t b = 0; b + 1 < song.sysexBytes; ++b)
+						out.push_back((uint8_t)random.Next(128));
+					out.push_back(0xF7);
+					running = false;
+				}
+
+				if (i % 64 == 63) {
+					PutVar(out, 0);
+					out.insert(out.end(), {(uint8_t)(0xB0 | channel), 64, (uint8_t)random.Next(128)});
+					running = false;
+				}
+
+				const uint8_t note = (uint8_t)(36 + random.Next(60));
+				PutVar(out, random.Next(4) ? random.Next(24) : 0);
+				if (!running)
+					out.push_back(0x90 | channel);
+				out.insert(out.end(), {note, (uint8_t)(1 + random.Next(126))});
+
+				PutVar(out, 1 + random.Next(48));
+				out.insert(out.end(), {note, 0});
+				running = true;
+			}
+		});
+	}
+
+	return out;
+}
+
+// Declared as the real one, but never lets anything out. Measures everything up to SendInput, and none of SendInput.
+class BenchEmitter : public KeyboardEmitter {
+protected:
+	void Dispatch(std::span<INPUT> inputs) const override {
+		sent += inputs.size();
+	}
+
+public:
+	mutable uint64_t sent = 0;
+	using KeyboardEmitter::KeyboardEmitter;
+};
+
+static void BenchParse() {
+	static constexpr SyntheticSong songs[] = {
+		{"dense", 64, 40000, 2000, 0},
+		{"tempo", 4, 20000, 200000, 0},
+		{"sysex", 8, 20000, 100, 4096},
+	};
+
+	for (const SyntheticSong& song : songs) {
+		const std::vector<uint8_t> data = SyntheticMidi(song);
+		size_t events = 0;
+		uint64_t sink = 0;
+
+		double ms = BestMs(3, [&] {
+			auto parsed = MidiFileParser::Parse(std::span<const uint8_t>(data));
+			events = parsed.size();
+			return parsed.empty() ? 0 : parsed[parsed.size() - 1].timeMs;
+		}, sink);
+
+		printf("parse song=%s tracks=%u bytes=%zu events=%zu ms=%.3f mb_s=%.1f mevents_s=%.2f\n",
+			song.name, song.tracks + 1u, data.size(), events, ms,
+			data.size() / 1e6 / (ms / 1000), events / 1e6 / (ms / 1000));
+	}
+}
+
+static void BenchTempo() {
+	constexpr uint16_t tpqn = 480;
+	constexpr size_t eventCount = 200000;
+	constexpr uint32_t songTicks = 10'000'000;
+
+	// Tempo-ramp heavy maps, evenly spread, like a DAW rubato export.
+	for (size_t tempoCount : {10, 1000, 10000}) {
+		std::vector<TempoMap::TempoChange> changes;
+		for (size_t i = 0; i < tempoCount; ++i)
+			changes.push_back({(uint32_t)(i * (songTicks / tempoCount)), (uint32_t)(400000 + (i * 7919) % 200000)});
+
+		// Events come as several tick-sorted tracks back to back, same as the parser produces them.
+		std::vector<uint32_t> ticks(eventCount);
+		for (size_t i = 0; i < eventCount; ++i)
+			ticks[i] = (uint32_t)((i % (eventCount / 8)) * (songTicks / (eventCount / 8)));
+
+		const TempoMap map(changes, tpqn);
+		uint64_t naiveSum = 0;
+		uint64_t searchSum = 0;
+		uint64_t cursorSum = 0;
+
+		double naiveMs = TimeMs([&] { uint64_t sum = 0; for (auto t : ticks) sum += NaiveTickToUs(t, changes, tpqn); return sum; }, naiveSum);
+		double searchMs = TimeMs([&] { uint64_t sum = 0; for (auto t : ticks) sum += map.TickToUs(t); return sum; }, searchSum);
+		double cursorMs = TimeMs([&] { uint64_t sum = 0; TempoMap::Cursor c(map); for (auto t : ticks) sum += c.TickToUs(t); return sum; }, cursorSum);
+
+		printf("tempo_convert tempos=%zu events=%zu naive_ms=%.3f search_ms=%.3f cursor_ms=%.3f match=%d\n",
+			tempoCount, eventCount, naiveMs, searchMs, cursorMs, naiveSum == searchSum && naiveSum == cursorSum);
+	}
+}
+
+static void BenchMapping() {
+	constexpr size_t count = 10'000'000;
+	BenchRandom random{42};
+
+	// Full MIDI range plus some transposed off the end, same as what the compiler throws at it.
+	std::vector<int> notes(count);
+	for (int& note : notes)
+		note = (int)random.Next(152) - 12;
+
+	for (bool whitesOnly : {false, true}) {
+		const MidiMapper mapper(whitesOnly ? whitesLayout : fullLayout);
+		uint64_t mapSum = 0;
+		uint64_t compressSum = 0;
+
+		double mapMs = BestMs(3, [&] {
+			uint64_t sum = 0;
+			for (int note : notes)
+				sum += mapper.MapNote(note).value_or(0);
+			return sum;
+		}, mapSum);
+
+		double compressMs = BestMs(3, [&] {
+			uint64_t sum = 0;
+			for (int note : notes)
+				sum += mapper.MapNote(Compress(note, mapper.Min(), mapper.Max())).value_or(0);
+			return sum;
+		}, compressSum);
+
+		printf("map layout=%s notes=%zu map_ns=%.2f compress_map_ns=%.2f\n",
+			whitesOnly ? "15" : "22", count, mapMs * 1e6 / count, compressMs * 1e6 / count);
+	}
+}
+
+static void BenchCompile() {
+	const std::vector<uint8_t> data = SyntheticMidi({"dense", 64, 40000, 2000, 0});
+	const MidiEvents events = MidiFileParser::Parse(std::span<const uint8_t>(data));
+	const MidiMapper mapper(fullLayout);
+	const BenchEmitter emitter(GetKeyboardLayout(0));
+
+	for (bool collapse : {false, true}) {
+		const ScheduleCompiler compiler(mapper, emitter, 0, true, collapse);
+		size_t keys = 0;
+		uint64_t sink = 0;
+
+		double ms = BestMs(3, [&] {
+			auto schedule = compiler.Compile(events);
+			keys = schedule.size();
+			return (uint64_t)keys;
+		}, sink);
+
+		printf("compile collapse=%d events=%zu keys=%zu ms=%.3f mevents_s=%.2f\n",
+			collapse, events.size(), keys, ms, events.size() / 1e3 / ms);
+	}
+}
+
+static void BenchEmit() {
+	constexpr size_t keyCount = 4'000'000;
+	const BenchEmitter emitter(GetKeyboardLayout(0));
+
+	std::vector<KeyStroke> keys(keyCount);
+	for (size_t i = 0; i < keyCount; ++i)
+		keys[i] = emitter.Resolve('A' + (int)(i % 26), i % 2 == 0);
+
+	// Chord size decides how many Dispatches (i.e. SendInputs) there are. 1 is a melody, 100 goes over the batch size.
+	for (size_t chord : {1, 8, 100}) {
+		uint64_t sink = 0;
+
+		double ms = BestMs(3, [&] {
+			emitter.sent = 0;
+			for (size_t i = 0; i < keyCount; i += chord)
+				emitter.SendKeys(std::span(keys).subspan(i, std::min(chord, keyCount - i)));
+			return emitter.sent;
+		}, sink);
+
+		printf("emit chord=%zu keys=%zu ns_per_key=%.2f sent=%llu\n", chord, keyCount, ms * 1e6 / keyCount, (unsigned long long)sink);
+	}
+}
+
+// One line per result, "name key=value ...", so it diffs and greps nicely between builds.
+static int RunBenchmarks() {
+	BenchParse();
+	BenchTempo();
+	BenchMapping();
+	BenchCompile();
+	BenchEmit();
+	return 0;
+}
+
 int main() {
-	WinMain(GetModuleHandle(nullptr), nullptr, nullptr, SW_SHOWDEFAULT);
+	return RunBenchmarks();
+}
+#else
+// If input is main instead of WinMain, just use WinMain anyway. Already got a console, so arguments can go straight to the command line mode.
+int main(int argc, char** argv) {
+	if (argc > 1)
+		return RunCli(argc, argv);
+
+	return WinMain(GetModuleHandle(nullptr), nullptr, nullptr, SW_SHOWDEFAULT);
 }
+#endif